@@ -0,0 +1,241 @@
+//Throughput of the vectorized paths (Base64, UTF-8, search) in GB/s of input.
+//make bench runs it first with --baseline, which measures the code these paths
+//replaced, then with GENCODER_NO_SIMD set, which takes their scalar fallbacks,
+//and last with vectorization.
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <array>
+#include <vector>
+#include <iterator>
+#include <cstring>
+
+#include "../transforms/b64.h"
+#include "../transforms/utf.h"
+#include "../utf8_simd.h"
+#include "../search.h"
+#include "../simd.h"
+#include "../utf8.h"
+#include "../utf8_charclass.h"
+
+//Returns the best throughput of a few runs of f over size bytes
+template <typename function>
+static double gigabytes_per_second(size_t size, function&& f)
+{
+	double best = 1e9;
+	for (int run = 0; run < 3; run++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		f();
+		best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	}
+	return size / best / 1e9;
+}
+
+//The code paths as they were before the vectorized series, on the containers
+//documents used then, so the speedups are measured against what they replaced
+namespace baseline
+{
+	static const std::string base64_chars =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+		"abcdefghijklmnopqrstuvwxyz"
+		"0123456789+/";
+
+	static inline bool is_base64(char c) {
+		return (isalnum(c) || (c == '+') || (c == '/'));
+	}
+
+	static std::vector<char> base64_decode(const std::vector<utf8::uint32_t>& input)
+	{
+		std::vector<char> result;
+		int i = 0;
+		std::array<char, 4> char_array;
+		int equals_count = 0;
+
+		for (auto&& a : input)
+		{
+			if (utf8::is_space(a))
+			{
+				continue;
+			}
+			if (equals_count > 2)
+			{
+				throw TransformError("Invalid base64 input");
+			}
+			if (a == '=')
+			{
+				equals_count++;
+				continue;
+			}
+			if (equals_count != 0)
+			{
+				throw TransformError("Invalid base64 input");
+			}
+			if (a >= 128 || !is_base64(a))
+			{
+				throw TransformError("Encountered a non-base64 char");
+			}
+			char_array[i++] = (char)a;
+			if (i == 4)
+			{
+				for (i = 0; i < 4; i++)
+				{
+					char_array[i] = (char)base64_chars.find(char_array[i]);
+				}
+				result.push_back((char_array[0] << 2) + ((char_array[1] & 0x30) >> 4));
+				result.push_back(((char_array[1] & 0xf) << 4) + ((char_array[2] & 0x3c) >> 2));
+				result.push_back(((char_array[2] & 0x3) << 6) + char_array[3]);
+				i = 0;
+			}
+		}
+		if (i) {
+			for (int j = i; j < 4; j++)
+				char_array[j] = 0;
+			for (int j = 0; j < i; j++)
+				char_array[j] = (char)base64_chars.find(char_array[j]);
+			result.push_back((char_array[0] << 2) + ((char_array[1] & 0x30) >> 4));
+			if (i > 2)
+			{
+				result.push_back(((char_array[1] & 0xf) << 4) + ((char_array[2] & 0x3c) >> 2));
+			}
+		}
+		return result;
+	}
+
+	static std::vector<utf8::uint32_t> base64_encode(const std::vector<char>& input)
+	{
+		std::vector<utf8::uint32_t> result;
+		size_t i = 0;
+		std::array<char, 3> byte_array;
+
+		for (auto&& a : input)
+		{
+			byte_array[i++] = a;
+			if (i == 3)
+			{
+				result.push_back(base64_chars[(byte_array[0] & 0xfc) >> 2]);
+				result.push_back(base64_chars[((byte_array[0] & 0x03) << 4) + ((byte_array[1] & 0xf0) >> 4)]);
+				result.push_back(base64_chars[((byte_array[1] & 0x0f) << 2) + ((byte_array[2] & 0xc0) >> 6)]);
+				result.push_back(base64_chars[byte_array[2] & 0x3f]);
+				i = 0;
+			}
+		}
+		if (i) {
+			for (size_t j = i; j < 3; j++)
+			{
+				byte_array[j] = 0;
+			}
+			result.push_back(base64_chars[(byte_array[0] & 0xfc) >> 2]);
+			result.push_back(base64_chars[((byte_array[0] & 0x03) << 4) + ((byte_array[1] & 0xf0) >> 4)]);
+			if (i == 2)
+			{
+				result.push_back(base64_chars[((byte_array[1] & 0x0f) << 2) + ((byte_array[2] & 0xc0) >> 6)]);
+			}
+			for (size_t j = i; j < 3; j++)
+			{
+				result.push_back('=');
+			}
+		}
+		return result;
+	}
+
+	static std::vector<utf8::uint32_t> utf8_decode(const std::vector<char>& input)
+	{
+		std::vector<utf8::uint32_t> result;
+		for (auto it = input.begin(); it != input.end();)
+		{
+			result.push_back(utf8::next(it, input.end()));
+		}
+		return result;
+	}
+
+	static std::vector<char> utf8_encode(const std::vector<utf8::uint32_t>& input)
+	{
+		std::vector<char> result;
+		auto inserter = std::back_inserter(result);
+		for (auto&& cp : input)
+		{
+			utf8::append(cp, inserter);
+		}
+		return result;
+	}
+
+	//Measures the same operations as main with the code above
+	static void run(size_t size, std::mt19937& rng)
+	{
+		std::vector<char> bytes(size);
+		std::generate(bytes.begin(), bytes.end(), [&]() { return (char)rng(); });
+		std::vector<utf8::uint32_t> encoded = base64_encode(bytes);
+		std::printf("  Base64 encode  %6.2f GB/s\n", gigabytes_per_second(size, [&]() { base64_encode(bytes); }));
+		std::printf("  Base64 decode  %6.2f GB/s\n", gigabytes_per_second(encoded.size(), [&]() { base64_decode(encoded); }));
+
+		std::vector<char> text;
+		text.reserve(size + 8);
+		while (text.size() < size)
+		{
+			const char* chunk = rng() % 10 == 0 ? "\xc5\x99" : "abcdefgh";
+			text.insert(text.end(), chunk, chunk + std::strlen(chunk));
+		}
+		//Kept so the inlined check isn't optimized away
+		volatile bool valid;
+		std::printf("  UTF-8 validate %6.2f GB/s\n", gigabytes_per_second(text.size(), [&]() { valid = utf8::is_valid(text.begin(), text.end()); }));
+		(void)valid;
+		std::vector<utf8::uint32_t> decoded;
+		std::printf("  UTF-8 decode   %6.2f GB/s\n", gigabytes_per_second(text.size(), [&]() { decoded = utf8_decode(text); }));
+		std::printf("  UTF-8 encode   %6.2f GB/s\n", gigabytes_per_second(text.size(), [&]() { utf8_encode(decoded); }));
+		//There was no search before the series
+	}
+}
+
+int main(int argc, char** argv)
+{
+	bool run_baseline = argc > 1 && std::string(argv[1]) == "--baseline";
+	if (run_baseline)
+	{
+		argc--;
+		argv++;
+	}
+	size_t megabytes = argc > 1 ? (size_t)std::atoi(argv[1]) : 64;
+	size_t size = megabytes << 20;
+	std::mt19937 rng(1);
+	if (run_baseline)
+	{
+		std::printf("%zu MB inputs, code before vectorization\n", megabytes);
+		baseline::run(size, rng);
+		return 0;
+	}
+	std::printf("%zu MB inputs, %s\n", megabytes,
+		simd::has_avx2() ? "vectorized (AVX2)" : simd::has_ssse3() ? "vectorized (SSSE3)" : "scalar fallback");
+
+	OctetDocument bytes;
+	bytes.data.resize(size);
+	std::generate(bytes.data.mutable_data(), bytes.data.mutable_data() + size, [&]() { return (char)rng(); });
+	std::unique_ptr<Document> encoded = Base64Encode().transform(bytes);
+	std::printf("  Base64 encode  %6.2f GB/s\n", gigabytes_per_second(size, [&]() { Base64Encode().transform(bytes); }));
+	std::printf("  Base64 decode  %6.2f GB/s\n", gigabytes_per_second(dynamic_cast<UnicodeDocument&>(*encoded).data.size(), [&]()
+	{
+		Base64Decode().transform(*encoded);
+	}));
+
+	//Mostly ASCII with some two byte characters, like most real text
+	std::string text;
+	text.reserve(size + 8);
+	while (text.size() < size)
+	{
+		text += rng() % 10 == 0 ? "\xc5\x99" : "abcdefgh";
+	}
+	std::printf("  UTF-8 validate %6.2f GB/s\n", gigabytes_per_second(text.size(), [&]() { utf8::first_invalid(text.data(), text.size()); }));
+	UnicodeString decoded;
+	std::printf("  UTF-8 decode   %6.2f GB/s\n", gigabytes_per_second(text.size(), [&]() { decoded = decode_utf8(text.data(), text.size()); }));
+	OctetBuffer reencoded;
+	std::printf("  UTF-8 encode   %6.2f GB/s\n", gigabytes_per_second(text.size(), [&]() { encode_utf8(decoded, reencoded); }));
+
+	//A pattern whose first byte is common but which never occurs
+	std::string pattern = "abcdefgX";
+	std::printf("  Byte search    %6.2f GB/s\n", gigabytes_per_second(text.size(), [&]() { search::find(text.data(), text.size(), pattern, 0); }));
+	return 0;
+}
@@ -0,0 +1,307 @@
+//Differential check of the vectorized paths (Base64, UTF-8, search) against plain
+//reference implementations on random inputs. make check runs it once with the
+//vectorized paths and once with GENCODER_NO_SIMD set, so both paths are checked.
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <random>
+#include <algorithm>
+
+#include "../transforms/b64.h"
+#include "../transforms/utf.h"
+#include "../utf8_simd.h"
+#include "../utf8_charclass.h"
+#include "../search.h"
+#include "../simd.h"
+
+static std::mt19937 rng(1);
+static const std::string base64_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const size_t npos = std::string::npos;
+
+//Returns the Base64 decoding of the text, or false if it isn't valid Base64.
+//Follows the original scalar decoder, including its treatment of trailing codepoints.
+static bool reference_b64_decode(const UnicodeString& text, std::string& result)
+{
+	result.clear();
+	int quad[4];
+	size_t count = 0;
+	int equals_count = 0;
+	for (utf8::uint32_t a : text)
+	{
+		if (utf8::is_space(a))
+		{
+			continue;
+		}
+		if (equals_count > 2)
+		{
+			return false;
+		}
+		if (a == '=')
+		{
+			equals_count++;
+			continue;
+		}
+		if (equals_count != 0 || a >= 128 || base64_chars.find((char)a) == npos)
+		{
+			return false;
+		}
+		quad[count++] = (int)base64_chars.find((char)a);
+		if (count == 4)
+		{
+			result.push_back((char)((quad[0] << 2) | (quad[1] >> 4)));
+			result.push_back((char)((quad[1] << 4) | (quad[2] >> 2)));
+			result.push_back((char)((quad[2] << 6) | quad[3]));
+			count = 0;
+		}
+	}
+	std::fill(quad + count, quad + 4, 0);
+	if (count > 0)
+	{
+		result.push_back((char)((quad[0] << 2) | ((quad[1] & 0x30) >> 4)));
+	}
+	if (count > 2)
+	{
+		result.push_back((char)(((quad[1] & 0xF) << 4) | ((quad[2] & 0x3C) >> 2)));
+	}
+	return true;
+}
+
+static std::string reference_b64_encode(const std::string& data)
+{
+	std::string result;
+	for (size_t i = 0; i < data.size(); i += 3)
+	{
+		unsigned long group = 0;
+		size_t count = std::min((size_t)3, data.size() - i);
+		for (size_t j = 0; j < 3; j++)
+		{
+			group = group << 8 | (j < count ? (unsigned char)data[i + j] : 0);
+		}
+		for (size_t j = 0; j < 4; j++)
+		{
+			result += j <= count ? base64_chars[(group >> (18 - 6 * j)) & 0x3F] : '=';
+		}
+	}
+	return result;
+}
+
+static std::string export_document(const Document& document)
+{
+	std::ostringstream output;
+	document.do_export(output);
+	return output.str();
+}
+
+static bool check_b64_decode(int iterations)
+{
+	for (int iteration = 0; iteration < iterations; iteration++)
+	{
+		UnicodeDocument input;
+		size_t length = rng() % 300;
+		bool clean = rng() % 4 == 0;
+		for (size_t i = 0; i < length; i++)
+		{
+			int r = rng() % 1000;
+			if (clean || r < 980)
+			{
+				input.data.push_back(base64_chars[rng() % 64]);
+			}
+			else if (r < 988)
+			{
+				input.data.push_back(" \n\r\t"[rng() % 4]);
+			}
+			else if (r < 993)
+			{
+				input.data.push_back('=');
+			}
+			else {
+				input.data.push_back(rng() % (r < 997 ? 0x100 : 0x11000));
+			}
+		}
+		std::string expected, result;
+		bool valid = reference_b64_decode(input.data, expected);
+		bool decoded = true;
+		try {
+			result = export_document(*Base64Decode().transform(input));
+		}
+		catch (const TransformError&)
+		{
+			decoded = false;
+		}
+		if (decoded != valid || (valid && result != expected))
+		{
+			std::printf("Base64 decode differs on input of %zu codepoints\n", input.data.size());
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool check_b64_encode(int iterations)
+{
+	for (int iteration = 0; iteration < iterations; iteration++)
+	{
+		std::string data(rng() % 400, '\0');
+		for (char& c : data)
+		{
+			c = (char)rng();
+		}
+		OctetDocument input;
+		input.data.append(data.data(), data.size());
+		if (export_document(*Base64Encode().transform(input)) != reference_b64_encode(data))
+		{
+			std::printf("Base64 encode differs on %zu bytes\n", data.size());
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool check_utf8(int iterations)
+{
+	const char* valid[] = { "a", "bcdefgh", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xed\x9f\xbf", "\xef\xbf\xbf", "\xf4\x8f\xbf\xbf" };
+	const char* invalid[] = { "\xc0\x80", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xe2\x82", "\x80", "\xff", "\xc3", "\xf0\x9f\x98", "\xe0\x80\x80", "\xf5\x80\x80\x80" };
+	for (int iteration = 0; iteration < iterations; iteration++)
+	{
+		std::string text;
+		size_t pieces = rng() % 60;
+		bool random = rng() % 3 == 0;
+		for (size_t i = 0; i < pieces; i++)
+		{
+			if (random)
+			{
+				text.push_back((char)rng());
+			}
+			else if (rng() % 50 == 0)
+			{
+				text += invalid[rng() % 10];
+			}
+			else {
+				text += valid[rng() % 8];
+			}
+		}
+
+		size_t expected = utf8::find_invalid(text.begin(), text.end()) - text.begin();
+		if (utf8::first_invalid(text.data(), text.size()) != expected)
+		{
+			std::printf("UTF-8 validation differs on %zu bytes\n", text.size());
+			return false;
+		}
+		if (expected != text.size())
+		{
+			continue;
+		}
+
+		std::vector<utf8::uint32_t> codepoints;
+		for (auto it = text.begin(); it != text.end();)
+		{
+			codepoints.push_back(utf8::next(it, text.end()));
+		}
+		UnicodeString decoded = decode_utf8(text.data(), text.size());
+		if (!std::equal(decoded.begin(), decoded.end(), codepoints.begin(), codepoints.end()))
+		{
+			std::printf("UTF-8 decoding differs on %zu bytes\n", text.size());
+			return false;
+		}
+		OctetBuffer encoded;
+		encode_utf8(decoded, encoded);
+		if (std::string(encoded.data(), encoded.size()) != text)
+		{
+			std::printf("UTF-8 encoding differs on %zu codepoints\n", decoded.size());
+			return false;
+		}
+	}
+	return true;
+}
+
+static size_t reference_find(const std::vector<utf8::uint32_t>& text, const std::vector<utf8::uint32_t>& pattern, size_t from)
+{
+	for (size_t i = from; i + pattern.size() <= text.size(); i++)
+	{
+		if (std::equal(pattern.begin(), pattern.end(), text.begin() + i))
+		{
+			return i;
+		}
+	}
+	return npos;
+}
+
+static size_t reference_rfind(const std::vector<utf8::uint32_t>& text, const std::vector<utf8::uint32_t>& pattern, size_t before)
+{
+	if (pattern.size() > text.size())
+	{
+		return npos;
+	}
+	for (size_t i = std::min(before, text.size() - pattern.size() + 1); i-- > 0;)
+	{
+		if (std::equal(pattern.begin(), pattern.end(), text.begin() + i))
+		{
+			return i;
+		}
+	}
+	return npos;
+}
+
+static bool check_search(int iterations)
+{
+	const utf8::uint32_t alphabet[] = { 'a', 'b', 0, 0xFF, 0x100, 0xFFFF, 0x1F600 };
+	for (int iteration = 0; iteration < iterations; iteration++)
+	{
+		//Few distinct codepoints make many partial matches, the widest one sets the width
+		size_t letters = 2 + rng() % 5;
+		std::vector<utf8::uint32_t> text(rng() % 300);
+		for (auto& c : text)
+		{
+			c = alphabet[rng() % letters];
+		}
+		UnicodeString stored(text.begin(), text.end());
+		bool bytes = std::all_of(text.begin(), text.end(), [](utf8::uint32_t c) { return c < 0x100; });
+		std::string text_bytes(text.begin(), text.end());
+
+		for (int query = 0; query < 10; query++)
+		{
+			std::vector<utf8::uint32_t> pattern;
+			size_t length = rng() % (rng() % 4 ? 4 : 40);
+			size_t start = text.empty() ? 0 : rng() % text.size();
+			for (size_t i = 0; i < length; i++)
+			{
+				bool inside = rng() % 2 && start + i < text.size();
+				pattern.push_back(inside ? text[start + i] : alphabet[rng() % 7]);
+			}
+			size_t from = rng() % (text.size() + 3);
+			size_t found = reference_find(text, pattern, from);
+			size_t rfound = reference_rfind(text, pattern, from);
+			UnicodeString stored_pattern(pattern.begin(), pattern.end());
+			if (search::find(stored, stored_pattern, from) != found || search::rfind(stored, stored_pattern, from) != rfound)
+			{
+				std::printf("Codepoint search differs on %zu codepoints\n", text.size());
+				return false;
+			}
+			if (bytes && std::all_of(pattern.begin(), pattern.end(), [](utf8::uint32_t c) { return c < 0x100; }))
+			{
+				std::string pattern_bytes(pattern.begin(), pattern.end());
+				if (search::find(text_bytes.data(), text_bytes.size(), pattern_bytes, from) != found
+					|| search::rfind(text_bytes.data(), text_bytes.size(), pattern_bytes, from) != rfound)
+				{
+					std::printf("Byte search differs on %zu bytes\n", text.size());
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	int iterations = argc > 1 ? std::atoi(argv[1]) : 200000;
+	std::printf("Checking %d random inputs each, %s\n", iterations,
+		simd::has_avx2() ? "vectorized (AVX2)" : simd::has_ssse3() ? "vectorized (SSSE3)" : "without vectorization");
+	bool passed = check_b64_decode(iterations) && check_b64_encode(iterations)
+		&& check_utf8(iterations) && check_search(iterations);
+	std::printf(passed ? "All checks passed\n" : "Check FAILED\n");
+	return passed ? 0 : 1;
+}
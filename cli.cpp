@@ -0,0 +1,664 @@
+#include "cli.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <glob.h>
+#include <sys/stat.h>
+#endif
+
+#include "registry.h"
+#include "transforms/utf.h"
+
+namespace cli
+{
+	//Size of the input chunks when every transform of the chain can be streamed
+	static const size_t chunk_size = 1 << 20;
+	//Largest accepted number of worker threads
+	static const unsigned long max_jobs = 1024;
+
+	//Replaces a multipart document with its first part with the key, found through the key index
+	class SelectKey : public Transform
+	{
+		UnicodeString key;
+		std::string name;
+	public:
+		SelectKey(const std::string& name) : key(decode_utf8(name.data(), name.size())), name(name)
+		{
+
+		}
+
+		bool accepts_type(DocType type) const final
+		{
+			return type == MultipartDocumentType;
+		}
+
+		bool reverse_transform() const final
+		{
+			return false;
+		}
+
+		std::unique_ptr<Transform> get_reverse_transform() const final
+		{
+			return nullptr;
+		}
+
+		std::unique_ptr<Document> transform(const Document& input) const final
+		{
+			if (input.get_type() != MultipartDocumentType)
+			{
+				throw TransformError("Only parts of multipart documents can be selected");
+			}
+			const MultipartDocument& doc = static_cast<const MultipartDocument&>(input);
+			std::vector<size_t> positions = doc.find(key);
+			if (positions.empty())
+			{
+				throw TransformError("No part named " + name);
+			}
+			const Document& part = *doc.get_part(positions[0]).document;
+			switch (part.get_type())
+			{
+			case UnicodeDocumentType:
+			{
+				std::unique_ptr<UnicodeDocument> result = std::make_unique<UnicodeDocument>();
+				result->data = static_cast<const UnicodeDocument&>(part).data;
+				return std::move(result);
+			}
+			case OctetDocumentType:
+			{
+				std::unique_ptr<OctetDocument> result = std::make_unique<OctetDocument>();
+				const OctetBuffer& data = static_cast<const OctetDocument&>(part).data;
+				result->data.append(data.data(), data.size());
+				return std::move(result);
+			}
+			default:
+				throw TransformError("The part " + name + " is a multipart document, which can't be selected");
+			}
+		}
+
+		const std::string get_description() const final
+		{
+			return "Select " + name;
+		}
+	};
+
+	struct Options
+	{
+		std::vector<const Transform*> chain;
+		//Transforms of the chain that aren't in the registry
+		std::vector<std::unique_ptr<Transform>> owned;
+		std::vector<std::string> inputs;
+		//Number of worker threads, more than one enables the batch mode
+		size_t jobs = 1;
+		//Results are written to files in this directory instead of the standard output
+		std::string output_dir;
+	};
+
+	static void usage(const char* arg0)
+	{
+		std::cout << "Usage: " << arg0 << " [--decode LIST] [--encode LIST]... [options] [input...]" << std::endl
+			<< "Applies the transforms in order to every input (or the standard input" << std::endl
+			<< "if there is none or it is -) and writes the results to the standard output." << std::endl
+			<< "LIST is a comma separated list of transforms." << std::endl
+			<< "Inputs can be files, directories (all files in them) or quoted patterns like 'dir/*.txt'." << std::endl
+			<< "  -j, --jobs N           process N inputs in parallel (0 for one per CPU, at most 1024)" << std::endl
+			<< "  -o, --output-dir DIR   write every result to DIR/<input file name>" << std::endl
+			<< "  -f, --files-from FILE  read more inputs from FILE, one per line (- for stdin)" << std::endl
+			<< "  -s, --select KEY       continue with the first part of a multipart result named KEY" << std::endl
+			<< "  decoders: " << registry::list_names(DecodeTransformType) << std::endl
+			<< "  encoders: " << registry::list_names(EncodeTransformType) << std::endl;
+	}
+
+	//Appends the comma separated transforms to the chain, returns false on an unknown one
+	static bool parse_chain(TransformType type, const std::string& list, std::vector<const Transform*>& chain)
+	{
+		std::istringstream names(list);
+		std::string name;
+		while (std::getline(names, name, ','))
+		{
+			const Transform* transform = registry::find_transform(type, name);
+			if (transform == nullptr)
+			{
+				std::cerr << "Unknown " << (type == DecodeTransformType ? "decoder" : "encoder") << " " << name << "!" << std::endl;
+				return false;
+			}
+			chain.push_back(transform);
+		}
+		return true;
+	}
+
+	//Adds the input to the list, expanding directories to the files in them
+	//and patterns to the matching paths
+	static void add_input(const std::string& input, std::vector<std::string>& inputs)
+	{
+#ifndef _WIN32
+		struct stat info;
+		if (input != "-" && stat(input.c_str(), &info) == 0 && S_ISDIR(info.st_mode))
+		{
+			std::vector<std::string> files;
+			DIR* dir = opendir(input.c_str());
+			if (dir != NULL)
+			{
+				while (dirent* entry = readdir(dir))
+				{
+					std::string path = input + "/" + entry->d_name;
+					if (stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+					{
+						files.push_back(path);
+					}
+				}
+				closedir(dir);
+			}
+			std::sort(files.begin(), files.end());
+			inputs.insert(inputs.end(), files.begin(), files.end());
+			return;
+		}
+		if (input.find_first_of("*?[") != std::string::npos && stat(input.c_str(), &info) != 0)
+		{
+			glob_t matches;
+			if (glob(input.c_str(), 0, NULL, &matches) == 0)
+			{
+				//glob sorts the matches
+				for (size_t i = 0; i < matches.gl_pathc; i++)
+				{
+					inputs.push_back(matches.gl_pathv[i]);
+				}
+				globfree(&matches);
+				return;
+			}
+			globfree(&matches);
+		}
+#endif
+		inputs.push_back(input);
+	}
+
+	//Returns false if the list can't be read
+	static bool read_input_list(const std::string& filename, std::vector<std::string>& inputs)
+	{
+		std::ifstream file;
+		if (filename != "-")
+		{
+			file.open(filename);
+			if (!file)
+			{
+				std::cerr << "Failed to open file " << filename << "!" << std::endl;
+				return false;
+			}
+		}
+		std::istream& list = filename == "-" ? std::cin : file;
+		std::string line;
+		while (std::getline(list, line))
+		{
+			if (!line.empty())
+			{
+				add_input(line, inputs);
+			}
+		}
+		return true;
+	}
+
+	//Returns false if the arguments are invalid
+	static bool parse_options(int argc, char* argv[], Options& options)
+	{
+		bool only_inputs = false;
+		for (int i = 1; i < argc; i++)
+		{
+			std::string arg = argv[i];
+			if (only_inputs || arg == "-" || arg[0] != '-')
+			{
+				add_input(arg, options.inputs);
+			}
+			else if (arg == "--")
+			{
+				only_inputs = true;
+			}
+			else if ((arg == "--decode" || arg == "-d" || arg == "--encode" || arg == "-e") && i + 1 < argc)
+			{
+				TransformType type = (arg == "--decode" || arg == "-d") ? DecodeTransformType : EncodeTransformType;
+				if (!parse_chain(type, argv[++i], options.chain))
+				{
+					return false;
+				}
+			}
+			else if ((arg == "--select" || arg == "-s") && i + 1 < argc)
+			{
+				try {
+					options.owned.push_back(std::make_unique<SelectKey>(argv[++i]));
+				}
+				catch (const TransformError& e)
+				{
+					std::cerr << "Invalid key: " << e.what() << std::endl;
+					return false;
+				}
+				options.chain.push_back(options.owned.back().get());
+			}
+			else if ((arg == "--jobs" || arg == "-j") && i + 1 < argc)
+			{
+				const char* value = argv[++i];
+				char* end;
+				errno = 0;
+				unsigned long jobs = std::strtoul(value, &end, 10);
+				//strtoul skips spaces and negates values with a minus sign, so only digits are accepted
+				if (!std::isdigit((unsigned char)value[0]) || *end != '\0' || errno == ERANGE || jobs > max_jobs)
+				{
+					std::cerr << "Invalid number of jobs: " << value << std::endl;
+					return false;
+				}
+				options.jobs = jobs;
+				if (options.jobs == 0)
+				{
+					options.jobs = std::max(1u, std::thread::hardware_concurrency());
+				}
+			}
+			else if ((arg == "--output-dir" || arg == "-o") && i + 1 < argc)
+			{
+				options.output_dir = argv[++i];
+			}
+			else if ((arg == "--files-from" || arg == "-f") && i + 1 < argc)
+			{
+				if (!read_input_list(argv[++i], options.inputs))
+				{
+					return false;
+				}
+			}
+			else {
+				return false;
+			}
+		}
+		if (options.inputs.empty())
+		{
+			options.inputs.push_back("-");
+		}
+		return true;
+	}
+
+	static void write_output(const Document& doc, std::ostream& output)
+	{
+		if (doc.get_type() == MultipartDocumentType)
+		{
+			throw TransformError("The result is a multipart document, which can't be written out");
+		}
+		doc.do_export(output);
+	}
+
+	//Pushes a chunk through the streams starting at first and writes what comes out of the last one
+	static void push_chunk(std::vector<std::unique_ptr<TransformStream>>& streams, size_t first, const Document& chunk, std::ostream& output)
+	{
+		if (first == streams.size())
+		{
+			write_output(chunk, output);
+			return;
+		}
+		std::unique_ptr<Document> result = streams[first]->push(chunk);
+		push_chunk(streams, first + 1, *result, output);
+	}
+
+	//Runs the chain over the input in chunks, so memory use does not depend on the input size
+	static void run_streamed(std::vector<std::unique_ptr<TransformStream>>& streams, std::istream& input, std::ostream& output)
+	{
+		OctetDocument chunk;
+		while (true)
+		{
+			chunk.data.resize(chunk_size);
+			input.read(chunk.data.mutable_data(), chunk_size);
+			chunk.data.resize(input.gcount());
+			if (chunk.data.empty())
+			{
+				break;
+			}
+			push_chunk(streams, 0, chunk, output);
+		}
+		for (size_t i = 0; i < streams.size(); i++)
+		{
+			std::unique_ptr<Document> result = streams[i]->finish();
+			push_chunk(streams, i + 1, *result, output);
+		}
+	}
+
+	//Runs the chain over the whole document at once
+	static void run_whole(const std::vector<const Transform*>& chain, std::unique_ptr<Document> doc, std::ostream& output)
+	{
+		for (auto&& transform : chain)
+		{
+			doc = transform->transform(*doc);
+		}
+		write_output(*doc, output);
+	}
+
+	//Throws TransformError if the input can't be read or transformed
+	static void process_input(const std::vector<const Transform*>& chain, const std::string& filename, std::ostream& output)
+	{
+		std::vector<std::unique_ptr<TransformStream>> streams;
+		for (auto&& transform : chain)
+		{
+			std::unique_ptr<TransformStream> stream = transform->make_stream();
+			if (!stream)
+			{
+				streams.clear();
+				break;
+			}
+			streams.push_back(std::move(stream));
+		}
+		bool streamed = streams.size() == chain.size();
+
+		if (filename == "-")
+		{
+			if (streamed)
+			{
+				run_streamed(streams, std::cin, output);
+			}
+			else {
+				std::unique_ptr<OctetDocument> doc = std::make_unique<OctetDocument>();
+				doc->do_import(std::cin);
+				run_whole(chain, std::move(doc), output);
+			}
+			return;
+		}
+
+		std::unique_ptr<OctetDocument> doc = std::make_unique<OctetDocument>();
+		if (!streamed && doc->data.map_file(filename))
+		{
+			run_whole(chain, std::move(doc), output);
+			return;
+		}
+		std::ifstream input(filename, std::ios::binary);
+		if (!input)
+		{
+			throw TransformError("Failed to open file");
+		}
+		if (streamed)
+		{
+			run_streamed(streams, input, output);
+		}
+		else {
+			doc->do_import(input);
+			run_whole(chain, std::move(doc), output);
+		}
+	}
+
+	//Most bytes the outputs of the batch mode may hold in memory while waiting for their turn
+	static const size_t max_held = 64 << 20;
+
+	//Order in which the outputs of the batch mode reach the standard output
+	struct BatchOrder
+	{
+		std::mutex mutex;
+		std::condition_variable changed;
+		//Input whose output is written to the standard output now
+		size_t head = 0;
+		//Bytes held by the outputs of the inputs after it
+		size_t held = 0;
+	};
+
+	//Output of one input of the batch mode. While it is the input's turn, the output goes
+	//straight to the standard output. Before that it is held in memory, and writing blocks
+	//while the outputs waiting for their turn hold more than max_held bytes together.
+	class BatchOutput : public std::streambuf
+	{
+		BatchOrder& order;
+		size_t index;
+		std::string held;
+
+		void deliver(const char* bytes, size_t count)
+		{
+			std::unique_lock<std::mutex> lock(order.mutex);
+			order.changed.wait(lock, [&] { return order.head == index || order.held + count <= max_held; });
+			if (order.head != index)
+			{
+				held.append(bytes, count);
+				order.held += count;
+				return;
+			}
+			//What was held comes first, nothing else writes while it is our turn
+			std::string earlier = take_locked();
+			lock.unlock();
+			order.changed.notify_all();
+			std::cout.write(earlier.data(), earlier.size());
+			std::cout.write(bytes, count);
+		}
+
+		std::string take_locked()
+		{
+			std::string taken;
+			taken.swap(held);
+			order.held -= taken.size();
+			return taken;
+		}
+	protected:
+		int overflow(int c) override
+		{
+			if (c != EOF)
+			{
+				char byte = (char)c;
+				deliver(&byte, 1);
+			}
+			return c;
+		}
+
+		std::streamsize xsputn(const char* bytes, std::streamsize count) override
+		{
+			deliver(bytes, (size_t)count);
+			return count;
+		}
+	public:
+		BatchOutput(BatchOrder& order, size_t index) : order(order), index(index) {}
+
+		//Returns the output held since it was last written, once the input is done
+		std::string take()
+		{
+			std::string taken;
+			{
+				std::lock_guard<std::mutex> lock(order.mutex);
+				taken = take_locked();
+			}
+			order.changed.notify_all();
+			return taken;
+		}
+	};
+
+	//Outcome of one input of the batch mode
+	struct BatchResult
+	{
+		//Set when writing to the standard output
+		std::unique_ptr<BatchOutput> output;
+		std::string error;
+	};
+
+	//Returns the file the result of the input is written to in the output directory
+	static std::string output_path(const Options& options, const std::string& filename)
+	{
+		size_t slash = filename.find_last_of('/');
+		return options.output_dir + "/" + (slash == std::string::npos ? filename : filename.substr(slash + 1));
+	}
+
+	//Returns false if two inputs would be written to the same file of the output directory,
+	//like a/x and b/x, which would overwrite (or on failure remove) each other's result
+	static bool check_output_paths(const Options& options)
+	{
+		std::map<std::string, const std::string*> paths;
+		for (auto&& filename : options.inputs)
+		{
+			auto inserted = paths.emplace(output_path(options, filename), &filename);
+			if (!inserted.second)
+			{
+				std::cerr << "Inputs " << *inserted.first->second << " and " << filename
+					<< " would both be written to " << inserted.first->first << "!" << std::endl;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	static BatchResult process_batch_input(const Options& options, const std::string& filename, BatchOrder& order, size_t index)
+	{
+		BatchResult result;
+		std::string output_name;
+		try {
+			if (options.output_dir.empty())
+			{
+				result.output = std::make_unique<BatchOutput>(order, index);
+				std::ostream output(result.output.get());
+				process_input(options.chain, filename, output);
+			}
+			else {
+				output_name = output_path(options, filename);
+				std::ofstream output(output_name, std::ios::binary);
+				if (!output)
+				{
+					output_name.clear();
+					throw TransformError("Failed to create output file");
+				}
+				process_input(options.chain, filename, output);
+			}
+		}
+		catch (const std::exception& e)
+		{
+			result.error = e.what();
+			if (!output_name.empty())
+			{
+				std::remove(output_name.c_str());
+			}
+		}
+		return result;
+	}
+
+	//Processes the inputs on a fixed number of worker threads.
+	//At most twice as many inputs as there are workers are being processed or waiting
+	//to be written at a time, and the results are written (and errors reported) in input order.
+	//The output of a failed input is dropped, except what it wrote while it was its turn.
+	static int run_batch(const Options& options)
+	{
+		const size_t count = options.inputs.size();
+		const size_t max_in_flight = options.jobs * 2;
+		if (!options.output_dir.empty() && !check_output_paths(options))
+		{
+			return 1;
+		}
+
+		std::mutex mutex;
+		std::condition_variable finished;
+		std::condition_variable written;
+		std::map<size_t, BatchResult> results;
+		size_t next_input = 0;
+		size_t next_output = 0;
+		BatchOrder order;
+
+		auto worker = [&]()
+		{
+			while (true)
+			{
+				size_t index;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					written.wait(lock, [&] { return next_input >= count || next_input < next_output + max_in_flight; });
+					if (next_input >= count)
+					{
+						return;
+					}
+					index = next_input++;
+				}
+				BatchResult result = process_batch_input(options, options.inputs[index], order, index);
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					results[index] = std::move(result);
+				}
+				finished.notify_one();
+			}
+		};
+
+		std::vector<std::thread> workers;
+		for (size_t i = 0; i < std::min(options.jobs, count); i++)
+		{
+			workers.emplace_back(worker);
+		}
+
+		int status = 0;
+		for (size_t index = 0; index < count; index++)
+		{
+			BatchResult result;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				finished.wait(lock, [&] { return results.count(index) != 0; });
+				result = std::move(results[index]);
+				results.erase(index);
+				next_output = index + 1;
+			}
+			written.notify_all();
+
+			std::string rest = result.output ? result.output->take() : std::string();
+			if (!result.error.empty())
+			{
+				std::cerr << options.inputs[index] << ": " << result.error << std::endl;
+				status = 1;
+			}
+			else {
+				std::cout.write(rest.data(), rest.size());
+			}
+			{
+				std::lock_guard<std::mutex> lock(order.mutex);
+				order.head = index + 1;
+			}
+			order.changed.notify_all();
+		}
+
+		for (auto&& thread : workers)
+		{
+			thread.join();
+		}
+		return status;
+	}
+
+	bool is_requested(int argc, char* argv[])
+	{
+		return argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0';
+	}
+
+	int run(int argc, char* argv[])
+	{
+		Options options;
+		std::string first = argv[1];
+		if (first == "--help" || first == "-h" || !parse_options(argc, argv, options))
+		{
+			usage(argv[0]);
+			return first == "--help" || first == "-h" ? 0 : 1;
+		}
+
+		std::ios::sync_with_stdio(false);
+		if (options.jobs > 1 || !options.output_dir.empty())
+		{
+			int status = run_batch(options);
+			std::cout.flush();
+			return status;
+		}
+
+		int status = 0;
+		for (auto&& filename : options.inputs)
+		{
+			try {
+				process_input(options.chain, filename, std::cout);
+			}
+			catch (const std::exception& e)
+			{
+				std::cerr << filename << ": " << e.what() << std::endl;
+				status = 1;
+			}
+		}
+		std::cout.flush();
+		return status;
+	}
+}
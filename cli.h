@@ -0,0 +1,12 @@
+#pragma once
+
+//Non-interactive mode, which applies a chain of transforms to files or the
+//standard input and writes the result to the standard output without starting the gui
+namespace cli
+{
+	//Returns whether the command line asks for the non-interactive mode
+	bool is_requested(int argc, char* argv[]);
+
+	//Runs the non-interactive mode and returns the process exit code
+	int run(int argc, char* argv[]);
+}
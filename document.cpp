@@ -1,75 +1,145 @@
 #include "document.h"
 
-#include <iomanip>
-#include <sstream>
 #include <algorithm>
 #include <iterator>
+#include <cctype>
 
 #include "transform.h"
 #include "utf8.h"
 #include "utf8_charclass.h"
+#include "transforms/utf.h"
 
+#include <atomic>
 
-int OctetDocument::get_safe(size_t pos) const
+//Source of document generations, shared by all threads
+static std::atomic<unsigned long> next_generation(0);
+
+Document::Document() : generation(next_generation++)
+{
+}
+
+void Document::mark_dirty(size_t clean_prefix, size_t clean_suffix)
 {
-	if (pos >= data.size())
+	if (dirty)
 	{
-		return -1;
+		this->clean_prefix = std::min(this->clean_prefix, clean_prefix);
+		this->clean_suffix = std::min(this->clean_suffix, clean_suffix);
 	}
-	return (unsigned char)data[pos];
+	else {
+		this->clean_prefix = clean_prefix;
+		this->clean_suffix = clean_suffix;
+	}
+	dirty = true;
+	generation = next_generation++;
 }
 
-std::string OctetDocument::generate_preview(size_t width, size_t height) const
+//Counts the elements equal at the start and at the end of both sequences,
+//without letting the two counts overlap in either sequence
+template <typename sequence>
+static void find_clean(const sequence& before, const sequence& after, size_t& clean_prefix, size_t& clean_suffix)
 {
-	size_t bytes_on_line = (width - 3) / 4;
+	size_t common = std::min(before.size(), after.size());
+	clean_prefix = 0;
+	while (clean_prefix < common && before[clean_prefix] == after[clean_prefix])
+	{
+		clean_prefix++;
+	}
+	clean_suffix = 0;
+	while (clean_suffix < common - clean_prefix && before[before.size() - clean_suffix - 1] == after[after.size() - clean_suffix - 1])
+	{
+		clean_suffix++;
+	}
+}
 
-	std::ostringstream ss;
+//Two hex digits and the preview character of every byte value
+struct HexTables
+{
+	char hex[256][2];
+	char printable[256];
 
-	if (bytes_on_line == 0)
+	HexTables()
 	{
-		for (size_t i = 0; i < height; i++)
+		static const char digits[] = "0123456789abcdef";
+		for (int i = 0; i < 256; i++)
 		{
-			ss << std::endl;
+			hex[i][0] = digits[i >> 4];
+			hex[i][1] = digits[i & 15];
+			printable[i] = isprint(i) ? (char)i : '.';
 		}
 	}
+};
+static const HexTables hex_tables;
 
-	for (size_t linestart = 0; linestart < height * bytes_on_line; linestart += bytes_on_line)
+//Writes a line of the preview for count bytes, padded to bytes_on_line, and returns its end
+static char* format_hex_line(char* out, const unsigned char* bytes, size_t count, size_t bytes_on_line)
+{
+	for (size_t i = 0; i < count; i++)
 	{
-		for (size_t pos = linestart; pos < linestart + bytes_on_line; pos++)
-		{
-			int data = get_safe(pos);
-			if (data < 0)
-			{
-				ss << "   ";
-			}
-			else {
-				ss << std::hex << std::setw(2) << std::setfill('0') << data << ' ';
-			}
-		}
+		out[0] = hex_tables.hex[bytes[i]][0];
+		out[1] = hex_tables.hex[bytes[i]][1];
+		out[2] = ' ';
+		out += 3;
+	}
+	out = std::fill_n(out, (bytes_on_line - count) * 3, ' ');
+	*out++ = '|';
+	*out++ = ' ';
+	for (size_t i = 0; i < count; i++)
+	{
+		*out++ = hex_tables.printable[bytes[i]];
+	}
+	out = std::fill_n(out, bytes_on_line - count, ' ');
+	*out++ = '\n';
+	return out;
+}
 
-		ss << "| ";
+size_t OctetDocument::bytes_per_line(size_t width)
+{
+	return width < 7 ? 0 : (width - 3) / 4;
+}
 
-		for (size_t pos = linestart; pos < linestart + bytes_on_line; pos++)
+void OctetDocument::render_preview(std::string& buffer, size_t width, size_t height, size_t offset) const
+{
+	size_t bytes_on_line = bytes_per_line(width);
+	if (bytes_on_line == 0)
+	{
+		buffer.assign(height, '\n');
+		return;
+	}
+	size_t line_length = bytes_on_line * 4 + 3;
+	buffer.resize(height * line_length);
+	char* out = &buffer[0];
+	offset -= offset % bytes_on_line;
+	//Edits may have split the bytes of a line over several pieces
+	std::string line_bytes;
+	for (size_t line = 0; line < height; line++)
+	{
+		if (offset >= data.size())
 		{
-			int data = get_safe(pos);
-			if (data < 0)
-			{
-				ss << ' ';
-			}
-			else if (!isprint(data))
-			{
-				ss << '.';
-			}
-			else {
-				ss << (char)data;
-			}
+			out = format_hex_line(out, NULL, 0, bytes_on_line);
+			continue;
 		}
-
-		ss << std::endl;
+		size_t count = std::min(bytes_on_line, data.size() - offset);
+		line_bytes.clear();
+		data.visit(offset, count, [&](const char* first, const char* last) {
+			line_bytes.append(first, last);
+		});
+		out = format_hex_line(out, (const unsigned char*)line_bytes.data(), count, bytes_on_line);
+		offset += count;
 	}
+}
 
-	return ss.str();
+std::string OctetDocument::generate_preview(size_t width, size_t height) const
+{
+	std::string preview;
+	render_preview(preview, width, height, 0);
+	return preview;
+}
 
+void OctetDocument::edit(size_t pos, size_t count, const char* bytes, size_t n)
+{
+	size_t clean_suffix = data.size() - pos - count;
+	data.replace(pos, count, bytes, n);
+	mark_dirty(pos, clean_suffix);
 }
 
 bool OctetDocument::is_exportable() const
@@ -79,13 +149,30 @@ bool OctetDocument::is_exportable() const
 
 void OctetDocument::do_export(std::ostream & output) const
 {
-	output.write(&data[0], data.size());
+	//Written piece by piece, a mapped file isn't copied to memory for it
+	data.visit(0, data.size(), [&](const char* first, const char* last) {
+		output.write(first, last - first);
+	});
 }
 
 void OctetDocument::do_import(std::istream & input)
 {
 	data.clear();
-	data.insert(data.begin(), std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+	char buffer[65536];
+	while (input.read(buffer, sizeof(buffer)) || input.gcount() > 0)
+	{
+		data.append(buffer, (size_t)input.gcount());
+	}
+}
+
+void OctetDocument::do_reimport(std::istream & input)
+{
+	OctetDocument edited;
+	edited.do_import(input);
+	size_t clean_prefix, clean_suffix;
+	find_clean(data, edited.data, clean_prefix, clean_suffix);
+	data = std::move(edited.data);
+	mark_dirty(clean_prefix, clean_suffix);
 }
 
 DocType OctetDocument::get_type() const
@@ -93,41 +180,59 @@ DocType OctetDocument::get_type() const
 	return OctetDocumentType;
 }
 
-std::string UnicodeDocument::generate_preview(size_t width, size_t height) const
+size_t OctetDocument::memory_usage() const
 {
-	std::string s;
-	width--;
-	size_t line = 0, col = 0;
-	bool last_was_cr = false;
-	for (auto&& a : data)
+	return data.memory_usage();
+}
+
+//Rows of lines longer than this are wrapped from every such part of the line separately,
+//so no row is ever found by reading more than this from a line start
+static const size_t max_wrapped_length = 16 * 1024;
+
+LineIndex& UnicodeDocument::line_index() const
+{
+	if (lines_generation != get_generation())
 	{
-		if (col >= width)
-		{
-			s += '\n';
-			col = 0;
-			line++;
-		}
-		if (line >= height)
-			break;
+		lines.invalidate(get_clean_prefix());
+		lines_generation = get_generation();
+	}
+	return lines;
+}
+
+size_t UnicodeDocument::segment_start(size_t position, size_t& line_start) const
+{
+	LineIndex& index = line_index();
+	line_start = index.line_start(data, index.line_of(data, position));
+	size_t start = line_start + (position - line_start) / max_wrapped_length * max_wrapped_length;
+	//The newline ending a line belongs to the part before it
+	if (start > line_start && start < data.size() && utf8::is_newline(data[start]))
+	{
+		start -= max_wrapped_length;
+	}
+	return start;
+}
+
+size_t UnicodeDocument::row_end(size_t position, size_t line_start, size_t columns) const
+{
+	size_t limit = line_start + ((position - line_start) / max_wrapped_length + 1) * max_wrapped_length;
+	size_t col = 0;
+	size_t i = position;
+	while (i < data.size())
+	{
+		utf8::uint32_t a = data[i];
 		if (utf8::is_newline(a))
 		{
-			if (last_was_cr)
-			{
-				continue;
-			}
-			if (a == 0xD)
+			i++;
+			if (a == 0xD && i < data.size() && data[i] == 0xA)
 			{
-				last_was_cr = true;
-			}
-			else {
-				last_was_cr = false;
+				i++;
 			}
-			s += '\n';
-			col = 0;
-			line++;
-			continue;
+			return i;
+		}
+		if (i == limit || (col >= columns && col > 0))
+		{
+			return i;
 		}
-		utf8::append(a, std::back_inserter(s));
 		if (a == 0x9)
 		{
 			//it's a tabstop
@@ -136,13 +241,125 @@ std::string UnicodeDocument::generate_preview(size_t width, size_t height) const
 		else {
 			col++;
 		}
+		i++;
+	}
+	return i;
+}
+
+size_t UnicodeDocument::row_start(size_t position, size_t width) const
+{
+	size_t columns = width > 0 ? width - 1 : 0;
+	if (position >= data.size())
+	{
+		//After a final newline there is an empty row
+		if (data.empty() || utf8::is_newline(data[data.size() - 1]))
+		{
+			return data.size();
+		}
+		position = data.size() - 1;
 	}
-	for (size_t i = line; i < height; i++)
+	size_t line_start;
+	size_t row = segment_start(position, line_start);
+	while (true)
 	{
-		s += '\n';
+		size_t end = row_end(row, line_start, columns);
+		if (end > position)
+		{
+			return row;
+		}
+		row = end;
 	}
+}
 
-	return s;
+size_t UnicodeDocument::next_row(size_t position, size_t width) const
+{
+	if (position >= data.size())
+	{
+		return data.size();
+	}
+	LineIndex& index = line_index();
+	return row_end(position, index.line_start(data, index.line_of(data, position)), width > 0 ? width - 1 : 0);
+}
+
+size_t UnicodeDocument::previous_row(size_t position, size_t width) const
+{
+	if (position == 0)
+	{
+		return 0;
+	}
+	size_t line_start;
+	size_t row = segment_start(std::min(position, data.size()) - 1, line_start);
+	while (true)
+	{
+		size_t end = row_end(row, line_start, width > 0 ? width - 1 : 0);
+		if (end >= position)
+		{
+			return row;
+		}
+		row = end;
+	}
+}
+
+size_t UnicodeDocument::line_start(size_t line) const
+{
+	return line_index().line_start(data, line);
+}
+
+size_t UnicodeDocument::line_count() const
+{
+	return line_index().line_count(data);
+}
+
+size_t UnicodeDocument::render_preview(std::string& buffer, size_t width, size_t height, size_t position) const
+{
+	size_t columns = width > 0 ? width - 1 : 0;
+	buffer.clear();
+	//The first row needs its line start, the following ones find it as they go
+	size_t line_start = 0;
+	if (position > 0 && position < data.size())
+	{
+		LineIndex& index = line_index();
+		line_start = index.line_start(data, index.line_of(data, position));
+	}
+	for (size_t row = 0; row < height; row++)
+	{
+		if (position < data.size())
+		{
+			size_t end = row_end(position, line_start, columns);
+			for (; position < end; position++)
+			{
+				utf8::uint32_t a = data[position];
+				if (!utf8::is_newline(a))
+				{
+					utf8::append(a, std::back_inserter(buffer));
+				}
+			}
+			if (utf8::is_newline(data[end - 1]))
+			{
+				line_start = end;
+			}
+		}
+		buffer += '\n';
+	}
+	return position;
+}
+
+std::string UnicodeDocument::generate_preview(size_t width, size_t height) const
+{
+	std::string preview;
+	render_preview(preview, width, height, 0);
+	return preview;
+}
+
+void UnicodeDocument::edit(size_t pos, size_t count, const UnicodeString& text)
+{
+	//Forget the lines changed before, then only those from the edit on,
+	//instead of all from the first edit on
+	line_index().invalidate(pos);
+	size_t clean_suffix = data.size() - pos - count;
+	data.replace(pos, count, text);
+	mark_dirty(pos, clean_suffix);
+	lines_generation = get_generation();
 }
 
 bool UnicodeDocument::is_exportable() const
@@ -152,71 +369,209 @@ bool UnicodeDocument::is_exportable() const
 
 void UnicodeDocument::do_export(std::ostream & output) const
 {
-	std::ostream_iterator<char> outit(output);
-	for (auto&& a : data)
+	write_utf8(data, output);
+}
+
+void UnicodeDocument::do_import(std::istream & input)
+{
+	//Read the raw bytes in bulk and transcode them in one pass
+	OctetDocument raw;
+	raw.do_import(input);
+	data = decode_utf8(raw.data.data(), raw.data.size());
+}
+
+void UnicodeDocument::do_reimport(std::istream & input)
+{
+	UnicodeDocument edited;
+	edited.do_import(input);
+	size_t clean_prefix, clean_suffix;
+	find_clean(data, edited.data, clean_prefix, clean_suffix);
+	data = std::move(edited.data);
+	mark_dirty(clean_prefix, clean_suffix);
+}
+
+DocType UnicodeDocument::get_type() const
+{
+	return UnicodeDocumentType;
+}
+
+size_t UnicodeDocument::memory_usage() const
+{
+	return data.memory_usage() + lines.memory_usage();
+}
+
+MultipartEntry& MultipartDocument::get_part(size_t index)
+{
+	get_key(index);
+	MultipartEntry& part = data[index];
+	if (!part.document && !part.checked_out)
 	{
-		utf8::append(a, outit);
+		part.document = source->decode_document(part);
 	}
+	return part;
 }
 
-void UnicodeDocument::do_import(std::istream & input)
+const MultipartEntry& MultipartDocument::get_part(size_t index) const
 {
-	data.clear();
-	std::istreambuf_iterator<char> it(input.rdbuf());
-	std::istreambuf_iterator<char> eos;
+	//Decoding only fills in what the part already stands for
+	return const_cast<MultipartDocument*>(this)->get_part(index);
+}
+
+const UnicodeString& MultipartDocument::get_key(size_t index) const
+{
+	MultipartEntry& part = const_cast<MultipartEntry&>(data[index]);
+	if (part.encoded_key)
+	{
+		part.key = source->decode_key(part);
+		part.encoded_key = false;
+	}
+	return part.key;
+}
 
-	try {
-		for (; it != eos;)
+std::vector<size_t> MultipartDocument::find(const UnicodeString& key) const
+{
+	//Index the parts added since the last lookup
+	for (size_t i = key_index.size(); i < data.size(); i++)
+	{
+		key_index.insert(get_key(i).hash(), i);
+	}
+	std::vector<size_t> result;
+	key_index.find(key.hash(), [&](size_t position) {
+		if (get_key(position) == key)
 		{
-			data.push_back(utf8::next(it, eos));
+			result.push_back(position);
 		}
-	}
-	catch (const utf8::invalid_code_point &)
+	});
+	//Probing doesn't keep the order of the parts
+	std::sort(result.begin(), result.end());
+	return result;
+}
+
+//Order-preserving code of the codepoints of the key starting at depth, packing each
+//into the given number of bits (with 0 for those past its end)
+static std::uint64_t key_code(const UnicodeString& key, size_t depth, unsigned bits)
+{
+	std::uint64_t code = 0;
+	for (size_t i = depth; i < depth + 63 / bits; i++)
 	{
-		throw TransformError("UTF-8 Decoder encountered an invalid code point");
+		code = (code << bits) | (i < key.size() ? key[i] + 1 : 0);
 	}
-	catch (const utf8::not_enough_room &)
+	return code;
+}
+
+struct KeyCode
+{
+	//Two codes, so most keys are told apart by the first pass
+	std::uint64_t code[2];
+	size_t position;
+};
+
+//Sorts the positions by key from the codepoint at depth on. Comparing packed codes instead
+//of the keys themselves keeps the sort from visiting a scattered key at every comparison.
+static void sort_by_key(const MultipartDocument& doc, KeyCode* first, KeyCode* last, size_t depth, unsigned bits)
+{
+	size_t per_code = 63 / bits;
+	for (KeyCode* it = first; it != last; ++it)
 	{
-		throw TransformError("End of file in the middle of UTF-8 char");
+		const UnicodeString& key = doc.get_key(it->position);
+		it->code[0] = key_code(key, depth, bits);
+		it->code[1] = key_code(key, depth + per_code, bits);
 	}
-	catch (const utf8::invalid_utf8 &)
+	std::sort(first, last, [](const KeyCode& a, const KeyCode& b)
+	{
+		if (a.code[0] != b.code[0])
+		{
+			return a.code[0] < b.code[0];
+		}
+		return a.code[1] != b.code[1] ? a.code[1] < b.code[1] : a.position < b.position;
+	});
+	//Runs of equal codes are ordered by the codepoints that follow, unless their keys ended
+	std::uint64_t last_codepoint = (1 << bits) - 1;
+	for (KeyCode* run = first; run != last;)
 	{
-		throw TransformError("Input is not a valid UTF-8 document");
+		KeyCode* run_end = run + 1;
+		while (run_end != last && run_end->code[0] == run->code[0] && run_end->code[1] == run->code[1])
+		{
+			run_end++;
+		}
+		if (run_end - run > 1 && (run->code[1] & last_codepoint) != 0)
+		{
+			sort_by_key(doc, run, run_end, depth + 2 * per_code, bits);
+		}
+		run = run_end;
 	}
 }
 
-DocType UnicodeDocument::get_type() const
+size_t MultipartDocument::find_prefix(const UnicodeString& prefix, size_t after) const
 {
-	return UnicodeDocumentType;
+	if (key_order.size() != data.size())
+	{
+		std::vector<KeyCode> codes(data.size());
+		//Latin-1 keys fit 7 codepoints into a code, others only 3
+		bool latin1 = true;
+		for (size_t i = 0; i < data.size(); i++)
+		{
+			codes[i].position = i;
+			latin1 = latin1 && get_key(i).width() == 1;
+		}
+		sort_by_key(*this, codes.data(), codes.data() + codes.size(), 0, latin1 ? 9 : 21);
+		key_order.resize(data.size());
+		for (size_t i = 0; i < data.size(); i++)
+		{
+			key_order[i] = codes[i].position;
+		}
+	}
+
+	//The keys starting with the prefix follow each other in key order
+	auto first = std::lower_bound(key_order.begin(), key_order.end(), prefix, [this](size_t position, const UnicodeString& key)
+	{
+		return get_key(position) < key;
+	});
+	auto last = std::partition_point(first, key_order.end(), [&](size_t position)
+	{
+		return get_key(position).starts_with(prefix);
+	});
+	//Only the positions are compared, so even many matches are quick to go through
+	size_t next = data.size();
+	size_t wrapped = data.size();
+	for (auto it = first; it != last; ++it)
+	{
+		if (*it > after)
+		{
+			next = std::min(next, *it);
+		}
+		else {
+			wrapped = std::min(wrapped, *it);
+		}
+	}
+	return next != data.size() ? next : wrapped;
 }
 
 std::string MultipartDocument::generate_preview(size_t width, size_t height) const
 {
 	std::string s;
 
-	size_t line = 0;
-
-	for (auto&& item : data)
+	for (size_t line = 0; line < data.size(); line++)
 	{
 		if (line > height)
 			break;
+		const MultipartEntry& item = get_part(line);
 		
 		//This assumes that all code-points are at most one char wide when printed to console.
-		size_t lentoprint = std::min(item.first.size(), width-1);
+		size_t lentoprint = std::min(item.key.size(), width-1);
 		for (size_t i = 0; i < lentoprint; i++)
 		{
-			utf8::append(item.first[i], std::back_inserter(s));
+			utf8::append(item.key[i], std::back_inserter(s));
 		}
 		
 		if (width - lentoprint > 3)
 		{
 			s += ": ";
-			s += item.second->generate_preview(width - lentoprint - 2, 1);
+			s += item.document->generate_preview(width - lentoprint - 2, 1);
 		}
 		else {
 			s += "\n";
 		}
-		line++;
 	}
 	return s;
 }
@@ -236,7 +591,22 @@ void MultipartDocument::do_import(std::istream & input)
 	throw std::logic_error("Can't import a MultipartDocument");
 }
 
+void MultipartDocument::do_reimport(std::istream & input)
+{
+	throw std::logic_error("Can't import a MultipartDocument");
+}
+
 DocType MultipartDocument::get_type() const
 {
 	return MultipartDocumentType;
 }
+
+size_t MultipartDocument::memory_usage() const
+{
+	size_t usage = (source ? source->memory_usage() : 0) + key_index.memory_usage() + key_order.capacity() * sizeof(size_t);
+	for (auto&& part : data)
+	{
+		usage += part.key.memory_usage() + (part.document ? part.document->memory_usage() : 0);
+	}
+	return usage;
+}
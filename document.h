@@ -6,13 +6,40 @@
 #include <memory>
 
 #include "utf8.h"
+#include "unicode_string.h"
+#include "octet_buffer.h"
+#include "key_index.h"
+#include "line_index.h"
 
 enum DocType { OctetDocumentType, UnicodeDocumentType, MultipartDocumentType };
 
 //Base class for storing data in a specific format that can later be used with transforms
 class Document
 {
+	unsigned long generation;
+	bool dirty = false;
+	size_t clean_prefix = 0;
+	size_t clean_suffix = 0;
 public:
+	Document();
+
+	//Identifies the current contents: it changes whenever the document is modified
+	//and is never shared by two documents
+	unsigned long get_generation() const { return generation; }
+
+	//Records a modification that kept the first clean_prefix and the last clean_suffix
+	//elements (bytes, codepoints) unchanged, and changes the generation.
+	//Modifications add up until the document is replaced by a new one.
+	void mark_dirty(size_t clean_prefix = 0, size_t clean_suffix = 0);
+
+	//Whether the document was modified since it was created (usually by a transform)
+	bool is_dirty() const { return dirty; }
+	size_t get_clean_prefix() const { return clean_prefix; }
+	size_t get_clean_suffix() const { return clean_suffix; }
+
+	//Returns the approximate number of bytes of memory used by the contents
+	virtual size_t memory_usage() const = 0;
+
 	//Generate preview of the contents that when printed in a fixed-width font is
 	//exactly width x height characters.
 	virtual std::string generate_preview(size_t width, size_t height) const = 0;
@@ -26,6 +53,10 @@ public:
 	//Import data from the supplied stream
 	virtual void do_import(std::istream& input) = 0;
 
+	//Replace the contents with data from the supplied stream, marking the part that
+	//differs from the previous contents as dirty
+	virtual void do_reimport(std::istream& input) = 0;
+
 	//Return document format
 	virtual DocType get_type() const = 0;
 
@@ -36,36 +67,141 @@ public:
 //about their meaning
 class OctetDocument : public Document
 {
-	int get_safe(size_t pos) const;
 public:
-	std::vector<char> data;
+	OctetBuffer data;
 	std::string generate_preview(size_t width, size_t height) const final;
+	//Returns the number of bytes on a line of a preview width characters wide
+	static size_t bytes_per_line(size_t width);
+	//Replaces the contents of buffer with height lines of the preview, starting with the
+	//line containing offset. Only the bytes shown are read, and buffer keeps its memory.
+	void render_preview(std::string& buffer, size_t width, size_t height, size_t offset) const;
+	//Replaces count bytes at pos with n bytes, marking only the bytes from pos on up to the
+	//unchanged rest dirty. Takes time in the bytes written, inserting and deleting adds pieces
+	//to the buffer instead of moving the bytes after them, and keeps a mapped file mapped.
+	void edit(size_t pos, size_t count, const char* bytes, size_t n);
 	bool is_exportable() const final;
 	void do_export(std::ostream& output) const final;
 	void do_import(std::istream& input) final;
+	void do_reimport(std::istream& input) final;
 	DocType get_type() const final;
+	size_t memory_usage() const final;
 };
 
 //Document that stores data as a sequence of unicode codepoints
 class UnicodeDocument : public Document
 {	
+	mutable LineIndex lines;
+	mutable unsigned long lines_generation = get_generation();
+
+	//Returns the line index without the lines changed since it was last used
+	LineIndex& line_index() const;
+	//Returns the start of the part of a line that rows of the position are wrapped from
+	size_t segment_start(size_t position, size_t& line_start) const;
+	//Returns the start of the row after the one at position, in the line starting at line_start
+	size_t row_end(size_t position, size_t line_start, size_t columns) const;
 public:
-	std::vector<utf8::uint32_t> data;
+	UnicodeString data;
 	std::string generate_preview(size_t width, size_t height) const final;
+
+	//The preview is made of rows, which are lines wrapped to the width.
+	//Returns the start of the row containing the position
+	size_t row_start(size_t position, size_t width) const;
+	//Return the start of the row after or before the one starting at position
+	size_t next_row(size_t position, size_t width) const;
+	size_t previous_row(size_t position, size_t width) const;
+	//Returns the start of the line (counted from 0), or of the last one if there are fewer
+	size_t line_start(size_t line) const;
+	size_t line_count() const;
+	//Replaces the contents of buffer with height rows of the preview, starting with the row
+	//at position, and returns the position after them. Only the rows shown are read.
+	size_t render_preview(std::string& buffer, size_t width, size_t height, size_t position) const;
+	//Replaces count codepoints at pos with the text, marking the range dirty like
+	//OctetDocument::edit. The text keeps a gap at the edit, so an edit only moves the
+	//codepoints between it and the last one. Only the lines from the edited one on are
+	//searched again.
+	void edit(size_t pos, size_t count, const UnicodeString& text);
+
 	bool is_exportable() const final;
 	void do_export(std::ostream& output) const final;
 	void do_import(std::istream& input) final;
+	void do_reimport(std::istream& input) final;
 	DocType get_type() const final;
+	size_t memory_usage() const final;
+};
+
+//Single part of a MultipartDocument
+struct MultipartEntry
+{
+	//Left empty until the part is decoded
+	UnicodeString key;
+	std::unique_ptr<Document> document;
+	//Set while the key is still only in the source
+	bool encoded_key = false;
+	//Position of the encoded part (key and value) in the source text
+	size_t source_offset = 0;
+	size_t source_length = 0;
+	//Length of the encoded key at the start of the part
+	size_t source_key_length = 0;
+	//Set if the part was modified after it was decoded
+	bool dirty = false;
+	//Set while the document is moved out to work on it, the entry keeps its place
+	bool checked_out = false;
+};
+
+//Encoded text that the parts of a MultipartDocument are decoded from when they are first used
+class MultipartSource
+{
+public:
+	//Shared with the parts that are views of it
+	std::shared_ptr<UnicodeString> text = std::make_shared<UnicodeString>();
+
+	//Decode the key or the document of a part from its position in the text
+	virtual UnicodeString decode_key(const MultipartEntry& part) const = 0;
+	virtual std::unique_ptr<Document> decode_document(const MultipartEntry& part) const = 0;
+	//Decode them the same way, but without keeping anything in the source, so that
+	//several threads can read parts at once without decoding them for good
+	virtual UnicodeString read_key(const MultipartEntry& part) const = 0;
+	virtual std::unique_ptr<Document> read_document(const MultipartEntry& part) const = 0;
+	//Returns the approximate number of bytes of memory used by the text and decoded parts
+	virtual size_t memory_usage() const { return text->memory_usage(); }
+	virtual ~MultipartSource() = default;
 };
 
 //Document that stores multiple documents, each identified by a unicode sequence
 class MultipartDocument : public Document
 {	
 public:
-	std::vector < std::pair< std::vector<utf8::uint32_t>, std::unique_ptr<Document> > > data;
+	std::vector<MultipartEntry> data;
+	//Text of the parts that weren't decoded yet, if there are any
+	std::unique_ptr<MultipartSource> source;
+	//Positions of parts by key, built on the first lookup. Parts keep their
+	//positions even while checked out, so it never needs to be rebuilt.
+	mutable KeyIndex key_index;
+	//Positions of parts sorted by key (equal keys by position), built on the first
+	//prefix search and again once parts were added
+	mutable std::vector<size_t> key_order;
+	//Generation of the document the source text was copied from, which the source
+	//positions refer to. Set to our own generation if the parts were not decoded.
+	unsigned long source_generation;
+
+	MultipartDocument() : source_generation(get_generation()) {}
+
+	//Returns a part, decoding it first if it wasn't used yet.
+	//The document of a checked out part is null.
+	MultipartEntry& get_part(size_t index);
+	const MultipartEntry& get_part(size_t index) const;
+	//Returns the key of a part, decoding only the key if the part wasn't used yet
+	const UnicodeString& get_key(size_t index) const;
+	//Returns the positions of all parts with the key, in order
+	std::vector<size_t> find(const UnicodeString& key) const;
+	//Returns the position of the first part after the given one (wrapping around)
+	//whose key starts with the prefix, or data.size() if there is none
+	size_t find_prefix(const UnicodeString& prefix, size_t after) const;
 	std::string generate_preview(size_t width, size_t height) const final;
 	bool is_exportable() const final;
 	void do_export(std::ostream& output) const final;
 	void do_import(std::istream& input) final;
+	void do_reimport(std::istream& input) final;
 	DocType get_type() const final;
+	size_t memory_usage() const final;
 };
\ No newline at end of file
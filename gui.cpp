@@ -2,10 +2,22 @@
 
 #include "main.h"
 #include "transform.h"
+#include "registry.h"
+#include "progress.h"
+#include "transforms/utf.h"
+#include "search.h"
+#include "utf8_charclass.h"
 #include <string>
 #include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+#include <cerrno>
+#include <cctype>
+#include <future>
+#include <chrono>
 #include <curses.h>
 #include <clocale>
+#include <cwchar>
 
 
 #define ctrl(x)           ((x) & 0x1f)
@@ -16,8 +28,6 @@ namespace gui
 	WINDOW* menu = NULL;
 	WINDOW* currmenuw = NULL;
 
-	std::map < TransformType, std::vector<std::unique_ptr<Transform>>> availableTransforms;
-
 	//Stores information of the TransformType menu that is currently visible
 	TransformType opened_menu = NoneTransformType;
 
@@ -34,78 +44,882 @@ namespace gui
 	//Set when error is currently visible
 	bool in_error = false;
 
+	//Set while keys edit the octet or unicode document in place
+	bool editing = false;
+	//The document being edited
+	const Document* edit_document = NULL;
+	//Position of the byte or codepoint at the cursor, which may also be the end of the document
+	size_t edit_cursor = 0;
+	//Set in the octet document once the high nibble of the byte at the cursor was typed
+	bool edit_low_nibble = false;
+
+	//Run of text of a row drawn with the same attributes
+	struct Segment
+	{
+		attr_t attributes;
+		std::string text;
+
+		bool operator==(const Segment& other) const
+		{
+			return attributes == other.attributes && text == other.text;
+		}
+	};
+	typedef std::vector<Segment> Row;
+
+	//Rows of the next frame of each window
+	std::vector<Row> main_rows, menu_rows;
+	//Character cell of a window: the UTF-8 text of the character in it and its attributes.
+	//The cell after a character two cells wide is left empty.
+	struct Cell
+	{
+		attr_t attributes;
+		std::string text;
+
+		bool operator==(const Cell& other) const
+		{
+			return attributes == other.attributes && text == other.text;
+		}
+		bool operator!=(const Cell& other) const { return !(*this == other); }
+	};
+	//Row of a window as it was drawn
+	struct ShadowRow
+	{
+		std::vector<Cell> cells;
+		//Cleared when the row has characters of unknown width (like control characters),
+		//so its cells may not be where the terminal shows them
+		bool exact = true;
+	};
+
+	//Rows as they were last drawn in each window, only the cells that differ get written
+	std::vector<ShadowRow> main_shadow, menu_shadow;
+	//Set when the screen has to be cleared and drawn whole, like after it was overwritten
+	bool full_repaint = true;
+
+	//Number of cells written (or cleared) by the last frame, shown in the status bar when enabled
+	size_t frame_cells = 0;
+	size_t cells_written = 0;
+	bool show_frame_cells = false;
+
 	//Local function declarations
 	std::string get_input(const std::string & message);
-	void register_transforms();
+	void register_menus();
 	void draw_menu();
 	void open_menu(char which);
 	void close_menu();
+	void redraw();
+
+	//Appends the text to the rows, starting a new row after every newline
+	void add_text(std::vector<Row>& rows, const std::string& text, attr_t attributes = A_NORMAL)
+	{
+		if (rows.empty())
+		{
+			rows.emplace_back();
+		}
+		size_t start = 0;
+		while (true)
+		{
+			size_t end = text.find('\n', start);
+			size_t length = (end == std::string::npos ? text.size() : end) - start;
+			if (length > 0)
+			{
+				Row& row = rows.back();
+				if (!row.empty() && row.back().attributes == attributes)
+				{
+					row.back().text.append(text, start, length);
+				}
+				else {
+					row.push_back(Segment{ attributes, text.substr(start, length) });
+				}
+			}
+			if (end == std::string::npos)
+			{
+				break;
+			}
+			rows.emplace_back();
+			start = end + 1;
+		}
+	}
+
+	//Splits the row into the cells it is drawn in, expanding tabs like curses does.
+	//Returns false if it has characters of unknown width.
+	bool to_cells(const Row& row, ShadowRow& cells)
+	{
+		cells.cells.clear();
+		cells.exact = true;
+		for (auto&& segment : row)
+		{
+			const char* it = segment.text.data();
+			const char* end = it + segment.text.size();
+			while (it < end)
+			{
+				const char* start = it;
+				utf8::uint32_t codepoint = utf8::unchecked::next(it);
+				if (codepoint == '\t')
+				{
+					do
+					{
+						cells.cells.push_back(Cell{ segment.attributes, " " });
+					} while (cells.cells.size() % 8 != 0);
+					continue;
+				}
+				int columns = wcwidth((wchar_t)codepoint);
+				if (columns < 0)
+				{
+					//Curses draws these as several characters, like ^A
+					cells.exact = false;
+					columns = 1;
+				}
+				if (columns == 0 && !cells.cells.empty())
+				{
+					//Combining characters are drawn in the cell of the one before
+					cells.cells.back().text.append(start, it);
+					continue;
+				}
+				cells.cells.push_back(Cell{ segment.attributes, std::string(start, it) });
+				if (columns == 2)
+				{
+					cells.cells.push_back(Cell{ segment.attributes, std::string() });
+				}
+			}
+		}
+		return cells.exact;
+	}
+
+	//Writes the cells of the rows that differ from the shadow to the window, then makes them
+	//the shadow. Rows with characters of unknown width are written whole.
+	void present(WINDOW* window, std::vector<Row>& rows, std::vector<ShadowRow>& shadow, int window_height)
+	{
+		rows.resize(window_height);
+		shadow.resize(window_height);
+		ShadowRow cells;
+		for (int i = 0; i < window_height; i++)
+		{
+			ShadowRow& old = shadow[i];
+			if (!to_cells(rows[i], cells) || !old.exact)
+			{
+				wmove(window, i, 0);
+				wclrtoeol(window);
+				for (auto&& segment : rows[i])
+				{
+					wattrset(window, segment.attributes);
+					waddstr(window, segment.text.c_str());
+				}
+				cells_written += std::max(cells.cells.size(), old.cells.size());
+				std::swap(old, cells);
+				continue;
+			}
+
+			const std::vector<Cell>& now = cells.cells;
+			const std::vector<Cell>& before = old.cells;
+			for (size_t column = 0; column < now.size();)
+			{
+				if (column < before.size() && now[column] == before[column])
+				{
+					column++;
+					continue;
+				}
+				//Write the run of cells that differ, with the whole characters in it
+				size_t first = column;
+				while (first > 0 && now[first].text.empty())
+				{
+					first--;
+				}
+				size_t last = column + 1;
+				while (last < now.size() && (last >= before.size() || now[last] != before[last] || now[last].text.empty()))
+				{
+					last++;
+				}
+				wmove(window, i, (int)first);
+				for (size_t j = first; j < last; j++)
+				{
+					if (!now[j].text.empty())
+					{
+						wattrset(window, now[j].attributes);
+						waddstr(window, now[j].text.c_str());
+					}
+				}
+				cells_written += last - first;
+				column = last;
+			}
+			if (before.size() > now.size())
+			{
+				wmove(window, i, (int)now.size());
+				wclrtoeol(window);
+				cells_written += before.size() - now.size();
+			}
+			std::swap(old, cells);
+		}
+		wattrset(window, A_NORMAL);
+		rows.clear();
+	}
+
+	//Returns the offset in the UTF-8 text of the codepoint at index,
+	//counting a byte for each codepoint past the end of the text
+	size_t utf8_offset(const std::string& text, size_t index)
+	{
+		for (size_t i = 0; i < text.size(); i++)
+		{
+			if (((unsigned char)text[i] & 0xC0) != 0x80 && index-- == 0)
+			{
+				return i;
+			}
+		}
+		return text.size() + index;
+	}
+
+	//Draws the cells of the row from first to last reversed, padding the row with spaces
+	//if it is shorter, so the edit cursor also shows past the end of a line
+	void highlight(std::vector<Row>& rows, size_t row, size_t first, size_t last)
+	{
+		if (rows.size() <= row)
+		{
+			rows.resize(row + 1);
+		}
+		std::string text;
+		std::vector<attr_t> attributes;
+		for (auto&& segment : rows[row])
+		{
+			text += segment.text;
+			attributes.resize(text.size(), segment.attributes);
+		}
+		size_t begin = utf8_offset(text, first);
+		size_t end = utf8_offset(text, last);
+		if (text.size() < end)
+		{
+			text.resize(end, ' ');
+			attributes.resize(end, A_NORMAL);
+		}
+		std::fill(attributes.begin() + begin, attributes.begin() + end, A_REVERSE);
+
+		rows[row].clear();
+		for (size_t i = 0; i < text.size(); i++)
+		{
+			if (rows[row].empty() || rows[row].back().attributes != attributes[i])
+			{
+				rows[row].push_back(Segment{ attributes[i], std::string() });
+			}
+			rows[row].back().text += text[i];
+		}
+	}
 
 	//The currently higlighted part of the multipart document
 	size_t multipart_index = 0;
 	//The starting offest of the multipart document
 	size_t multipart_view_start = 0;
 
+	//Row of a part of the multipart document as drawn, rendered again only
+	//once the part's document changes or the width does
+	struct PartRow
+	{
+		unsigned long generation;
+		int width;
+		std::string text;
+	};
+	//Rows of the parts in view, by part index
+	std::map<size_t, PartRow> multipart_rows;
+	//The document the rows belong to
+	const Document* multipart_rows_document = NULL;
+
+	const std::string& get_part_row(const MultipartDocument& doc, size_t i)
+	{
+		const MultipartEntry& part = doc.get_part(i);
+		PartRow& row = multipart_rows[i];
+		if (!row.text.empty() && row.generation == part.document->get_generation() && row.width == width)
+		{
+			return row.text;
+		}
+		row.generation = part.document->get_generation();
+		row.width = width;
+		std::string& s = row.text;
+		s.clear();
+
+		size_t lentoprint = std::min(part.key.size(), (size_t)(width - 1));
+		for (size_t j = 0; j < lentoprint; j++)
+		{
+			utf8::append(part.key[j], std::back_inserter(s));
+		}
+
+		if (width - lentoprint > 3)
+		{
+			s += ": ";
+			s += part.document->generate_preview(width - lentoprint - 2, 1);
+		}
+		else {
+			s += "\n";
+		}
+		return s;
+	}
+
 	void draw_multipart()
 	{
 		MultipartDocument& doc = dynamic_cast<MultipartDocument&>(get_current_document());
-		while (multipart_index >= multipart_view_start + height - 1)
+		//Only the rows in view are ever looked at, so any jump takes the same time
+		size_t rows = (size_t)std::max(1, height - 1);
+		if (multipart_index >= multipart_view_start + rows)
+		{
+			multipart_view_start = multipart_index - rows + 1;
+		}
+		else if (multipart_index < multipart_view_start)
 		{
-			multipart_view_start++;
+			multipart_view_start = multipart_index;
 		}
-		while (multipart_index < multipart_view_start)
+		size_t view_end = std::min(multipart_view_start + height - 1, doc.data.size());
+
+		if (&doc != multipart_rows_document)
 		{
-			multipart_view_start--;
+			multipart_rows.clear();
+			multipart_rows_document = &doc;
 		}
+		//Forget the rows out of view
+		multipart_rows.erase(multipart_rows.begin(), multipart_rows.lower_bound(multipart_view_start));
+		multipart_rows.erase(multipart_rows.lower_bound(view_end), multipart_rows.end());
 		
-		for (size_t i = multipart_view_start; i < std::min(multipart_view_start + height - 1, doc.data.size()); i++)
+		for (size_t i = multipart_view_start; i < view_end; i++)
 		{
-			std::string s;
+			add_text(main_rows, get_part_row(doc, i), i == multipart_index ? A_REVERSE : A_NORMAL);
+		}
+	}
+
+	//Highlights another part (the last one if index is past it), which only
+	//writes the two rows that change if the view doesn't move
+	void move_highlight(size_t index)
+	{
+		size_t parts = dynamic_cast<MultipartDocument&>(get_current_document()).data.size();
+		close_menu();
+		multipart_index = std::min(index, parts > 0 ? parts - 1 : 0);
+		redraw();
+	}
 
-			size_t lentoprint = std::min(doc.data[i].first.size(), (size_t)(width - 1));
-			for (size_t j = 0; j < lentoprint; j++)
+	//The first byte shown of the octet document
+	size_t octet_view_offset = 0;
+	//The document the offset belongs to
+	const Document* octet_view_document = NULL;
+	//Reused by every redraw of the octet document
+	std::string octet_view_buffer;
+
+	void draw_octet()
+	{
+		OctetDocument& doc = dynamic_cast<OctetDocument&>(get_current_document());
+		if (&doc != octet_view_document)
+		{
+			octet_view_document = &doc;
+			octet_view_offset = 0;
+		}
+		//Keep the offset at the start of a line and the last page full.
+		//While editing, the cursor may also be after the last byte.
+		size_t bytes_on_line = std::max((size_t)1, OctetDocument::bytes_per_line(width));
+		size_t lines = (doc.data.size() + (editing ? 1 : 0) + bytes_on_line - 1) / bytes_on_line;
+		size_t last_start = lines > (size_t)(height - 1) ? (lines - (height - 1)) * bytes_on_line : 0;
+		octet_view_offset -= octet_view_offset % bytes_on_line;
+		if (editing)
+		{
+			//Scroll just enough to show the line of the cursor
+			size_t page = (size_t)std::max(1, height - 1) * bytes_on_line;
+			size_t cursor_line = edit_cursor - edit_cursor % bytes_on_line;
+			if (cursor_line < octet_view_offset)
+			{
+				octet_view_offset = cursor_line;
+			}
+			else if (cursor_line - octet_view_offset >= page)
 			{
-				utf8::append(doc.data[i].first[j], std::back_inserter(s));
+				octet_view_offset = cursor_line + bytes_on_line - page;
 			}
+		}
+		octet_view_offset = std::min(octet_view_offset, last_start);
 
-			if (width - lentoprint > 3)
+		doc.render_preview(octet_view_buffer, width, height - 1, octet_view_offset);
+		add_text(main_rows, octet_view_buffer);
+
+		if (editing && OctetDocument::bytes_per_line(width) > 0)
+		{
+			//The byte in hex, only its low nibble once the high one was typed, and as a character
+			size_t row = (edit_cursor - octet_view_offset) / bytes_on_line;
+			size_t column = edit_cursor % bytes_on_line;
+			highlight(main_rows, row, column * 3 + (edit_low_nibble ? 1 : 0), column * 3 + 2);
+			highlight(main_rows, row, bytes_on_line * 3 + 2 + column, bytes_on_line * 3 + 3 + column);
+		}
+	}
+
+	//Moves the octet view by the number of lines, up if it is negative
+	void scroll_octet(long long lines)
+	{
+		size_t bytes = (size_t)std::abs(lines) * std::max((size_t)1, OctetDocument::bytes_per_line(width));
+		if (lines < 0)
+		{
+			octet_view_offset = octet_view_offset > bytes ? octet_view_offset - bytes : 0;
+		}
+		else {
+			//Past the end is limited when drawing
+			octet_view_offset = bytes > SIZE_MAX - octet_view_offset ? SIZE_MAX : octet_view_offset + bytes;
+		}
+	}
+
+	//The first row shown of the unicode document
+	size_t unicode_view_position = 0;
+	//The position after the last row shown
+	size_t unicode_view_end = 0;
+	//The document, its generation and the width the rows were found for
+	const Document* unicode_view_document = NULL;
+	unsigned long unicode_view_generation = 0;
+	int unicode_view_width = 0;
+	//Reused by every redraw of the unicode document
+	std::string unicode_view_buffer;
+
+	void draw_unicode()
+	{
+		UnicodeDocument& doc = dynamic_cast<UnicodeDocument&>(get_current_document());
+		if (&doc != unicode_view_document)
+		{
+			unicode_view_document = &doc;
+			unicode_view_position = 0;
+		}
+		//Edits and resizing move the starts of rows
+		else if (doc.get_generation() != unicode_view_generation || width != unicode_view_width)
+		{
+			unicode_view_position = doc.row_start(unicode_view_position, width);
+		}
+		unicode_view_generation = doc.get_generation();
+		unicode_view_width = width;
+
+		//Row of the view the edit cursor is on
+		size_t cursor_row = 0;
+		if (editing)
+		{
+			//Scroll just enough to show the row of the cursor
+			size_t rows = (size_t)std::max(1, height - 1);
+			size_t cursor_start = doc.row_start(edit_cursor, width);
+			size_t position = unicode_view_position;
+			for (; position < cursor_start && cursor_row < rows; cursor_row++)
 			{
-				s += ": ";
-				s += doc.data[i].second->generate_preview(width - lentoprint - 2, 1);
+				position = doc.next_row(position, width);
 			}
-			else {
-				s += "\n";
+			if (cursor_start < unicode_view_position)
+			{
+				unicode_view_position = cursor_start;
+				cursor_row = 0;
 			}
+			else if (cursor_row == rows)
+			{
+				unicode_view_position = cursor_start;
+				for (cursor_row = 0; cursor_row + 1 < rows && unicode_view_position > 0; cursor_row++)
+				{
+					unicode_view_position = doc.previous_row(unicode_view_position, width);
+				}
+			}
+		}
+
+		unicode_view_end = doc.render_preview(unicode_view_buffer, width, height - 1, unicode_view_position);
+		add_text(main_rows, unicode_view_buffer);
+
+		if (editing)
+		{
+			//Newlines aren't drawn, so a cursor on one is right after the row's text
+			size_t column = edit_cursor - doc.row_start(edit_cursor, width);
+			highlight(main_rows, cursor_row, column, column + 1);
+		}
+	}
+
+	//Moves the unicode view by the number of rows, up if it is negative,
+	//but not further down than showing the last row at the bottom
+	void scroll_unicode(long long rows)
+	{
+		UnicodeDocument& doc = dynamic_cast<UnicodeDocument&>(get_current_document());
+		for (; rows < 0; rows++)
+		{
+			unicode_view_position = doc.previous_row(unicode_view_position, width);
+		}
+		for (; rows > 0 && unicode_view_end < doc.data.size(); rows--)
+		{
+			unicode_view_position = doc.next_row(unicode_view_position, width);
+			unicode_view_end = doc.next_row(unicode_view_end, width);
+		}
+	}
 
-			if (i == multipart_index)
+	//Starts editing the current document with the cursor at the top of the view
+	void start_editing()
+	{
+		Document& document = get_current_document();
+		switch (document.get_type())
+		{
+		case OctetDocumentType:
+			edit_cursor = std::min(octet_view_offset, dynamic_cast<OctetDocument&>(document).data.size());
+			break;
+		case UnicodeDocumentType:
+			edit_cursor = unicode_view_position;
+			break;
+		default:
+			return;
+		}
+		editing = true;
+		edit_document = &document;
+		edit_low_nibble = false;
+	}
+
+	//Handles a key editing the octet document, returns false if it isn't one
+	bool edit_octet(int ch)
+	{
+		OctetDocument& doc = dynamic_cast<OctetDocument&>(get_current_document());
+		size_t size = doc.data.size();
+		size_t bytes_on_line = std::max((size_t)1, OctetDocument::bytes_per_line(width));
+		size_t page = (size_t)std::max(1, height - 1) * bytes_on_line;
+		if (ch < 0x80 && std::isxdigit(ch))
+		{
+			//Overwrites the high nibble, then the low one and moves on. Typing at the end appends a byte.
+			unsigned char nibble = (unsigned char)(std::isdigit(ch) ? ch - '0' : std::tolower(ch) - 'a' + 10);
+			unsigned char byte = edit_cursor < size ? (unsigned char)doc.data[edit_cursor] : 0;
+			byte = edit_low_nibble ? (byte & 0xF0) | nibble : (byte & 0x0F) | (nibble << 4);
+			doc.edit(edit_cursor, edit_cursor < size ? 1 : 0, (const char*)&byte, 1);
+			edit_cursor += edit_low_nibble ? 1 : 0;
+			edit_low_nibble = !edit_low_nibble;
+			return true;
+		}
+		edit_low_nibble = false;
+		switch (ch)
+		{
+		case KEY_IC:
+		{
+			char zero = 0;
+			doc.edit(edit_cursor, 0, &zero, 1);
+			break;
+		}
+		case KEY_DC:
+			if (edit_cursor < size)
+			{
+				doc.edit(edit_cursor, 1, "", 0);
+			}
+			break;
+		case '\b':
+		case 127:
+		case KEY_BACKSPACE:
+			if (edit_cursor > 0)
 			{
-				wattron(main, A_REVERSE);
+				doc.edit(--edit_cursor, 1, "", 0);
 			}
+			break;
+		case KEY_LEFT:
+			edit_cursor -= edit_cursor > 0 ? 1 : 0;
+			break;
+		case KEY_RIGHT:
+			edit_cursor += edit_cursor < size ? 1 : 0;
+			break;
+		case KEY_UP:
+			edit_cursor -= edit_cursor >= bytes_on_line ? bytes_on_line : 0;
+			break;
+		case KEY_DOWN:
+			edit_cursor = size - edit_cursor > bytes_on_line ? edit_cursor + bytes_on_line : size;
+			break;
+		case KEY_PPAGE:
+			edit_cursor = edit_cursor > page ? edit_cursor - page : 0;
+			break;
+		case KEY_NPAGE:
+			edit_cursor = size - edit_cursor > page ? edit_cursor + page : size;
+			break;
+		case KEY_HOME:
+			edit_cursor = 0;
+			break;
+		case KEY_END:
+			edit_cursor = size;
+			break;
+		default:
+			return false;
+		}
+		return true;
+	}
 
-			waddstr(main, s.c_str());
+	//Moves the edit cursor of the unicode document to its column in the row rows away, up if it
+	//is negative, or to the end of the row if it is shorter
+	void move_unicode_cursor(UnicodeDocument& doc, long long rows)
+	{
+		size_t row = doc.row_start(edit_cursor, width);
+		size_t column = edit_cursor - row;
+		for (; rows < 0 && row > 0; rows++)
+		{
+			row = doc.previous_row(row, width);
+		}
+		for (; rows > 0; rows--)
+		{
+			//The end of the text only starts a row after a newline
+			size_t next = doc.next_row(row, width);
+			if (next == row || doc.row_start(next, width) != next)
+			{
+				break;
+			}
+			row = next;
+		}
+		//The cursor stays in front of the newline, or of the start of the next row
+		size_t end = doc.next_row(row, width);
+		if (end > row && utf8::is_newline(doc.data[end - 1]))
+		{
+			end--;
+			if (end > row && doc.data[end] == 0xA && doc.data[end - 1] == 0xD)
+			{
+				end--;
+			}
+		}
+		else if (end < doc.data.size())
+		{
+			end--;
+		}
+		edit_cursor = std::min(row + column, end);
+	}
 
-			wattroff(main, A_REVERSE);
+	//Handles a key editing the unicode document, returns false if it isn't one
+	bool edit_unicode(int ch)
+	{
+		UnicodeDocument& doc = dynamic_cast<UnicodeDocument&>(get_current_document());
+		size_t size = doc.data.size();
+		//The LF of CR LF is skipped, both end the line together
+		auto in_crlf = [&](size_t position)
+		{
+			return position > 0 && position < size && doc.data[position] == 0xA && doc.data[position - 1] == 0xD;
+		};
+		switch (ch)
+		{
+		case '\n':
+		case '\r':
+		case KEY_ENTER:
+		{
+			UnicodeString newline;
+			newline.push_back(0xA);
+			doc.edit(edit_cursor++, 0, newline);
+			break;
+		}
+		case KEY_DC:
+			if (edit_cursor < size)
+			{
+				doc.edit(edit_cursor, 1, UnicodeString());
+			}
+			break;
+		case '\b':
+		case 127:
+		case KEY_BACKSPACE:
+			if (edit_cursor > 0)
+			{
+				doc.edit(--edit_cursor, 1, UnicodeString());
+			}
+			break;
+		case KEY_LEFT:
+			edit_cursor -= edit_cursor > 0 ? 1 : 0;
+			edit_cursor -= in_crlf(edit_cursor) ? 1 : 0;
+			break;
+		case KEY_RIGHT:
+			edit_cursor += edit_cursor < size ? 1 : 0;
+			edit_cursor += in_crlf(edit_cursor) ? 1 : 0;
+			break;
+		case KEY_UP:
+			move_unicode_cursor(doc, -1);
+			break;
+		case KEY_DOWN:
+			move_unicode_cursor(doc, 1);
+			break;
+		case KEY_PPAGE:
+			move_unicode_cursor(doc, -(height - 1));
+			break;
+		case KEY_NPAGE:
+			move_unicode_cursor(doc, height - 1);
+			break;
+		case KEY_HOME:
+			edit_cursor = 0;
+			break;
+		case KEY_END:
+			edit_cursor = size;
+			break;
+		default:
+		{
+			//Typed characters come as the bytes of their UTF-8 encoding
+			if (ch != '\t' && (ch < ' ' || ch == 0x7F || (ch >= 0x80 && ch < 0xC0) || ch >= 0xF8))
+			{
+				return false;
+			}
+			std::string typed(1, (char)ch);
+			size_t length = ch >= 0xF0 ? 4 : ch >= 0xE0 ? 3 : ch >= 0xC0 ? 2 : 1;
+			while (typed.size() < length)
+			{
+				typed.push_back((char)wgetch(main));
+			}
+			try {
+				UnicodeString text = decode_utf8(typed.data(), typed.size());
+				doc.edit(edit_cursor, 0, text);
+				edit_cursor += text.size();
+			}
+			catch (const TransformError&)
+			{
+				//Not a character, nothing is inserted
+			}
+			break;
+		}
+		}
+		return true;
+	}
+
+	//Leaves edit mode, after which the edited text is read by transforms and searches
+	void stop_editing()
+	{
+		editing = false;
+		Document& document = get_current_document();
+		if (document.get_type() == UnicodeDocumentType)
+		{
+			dynamic_cast<UnicodeDocument&>(document).data.close_gap();
+		}
+	}
 
+	//Handles a key in edit mode, returns false if it isn't an edit key
+	bool edit_key(int ch)
+	{
+		if (ch == 27)
+		{
+			stop_editing();
+			return true;
+		}
+		if (get_current_document().get_type() == OctetDocumentType)
+		{
+			return edit_octet(ch);
 		}
+		return edit_unicode(ch);
 	}
 
+	//Reads a decimal number, or a hexadecimal one starting with 0x
+	bool parse_number(const std::string& in, unsigned long long& number)
+	{
+		bool hex = in.size() > 2 && in[0] == '0' && (in[1] == 'x' || in[1] == 'X');
+		char* end;
+		errno = 0;
+		number = std::strtoull(in.c_str() + (hex ? 2 : 0), &end, hex ? 16 : 10);
+		return !in.empty() && *end == '\0' && errno == 0 && in[0] != '-';
+	}
 
-	void redraw()
+	//The last pattern searched for
+	search::Pattern search_pattern;
+	//Position of the last match and the document it was found in
+	size_t search_match = 0;
+	const Document* search_document = NULL;
+	//Set when searching a multipart document also searches the contents of all
+	//parts in parallel, instead of only the keys
+	bool search_all_parts = false;
+
+	//Reads a pattern to search for, which is the text as typed, or bytes in hex
+	//after 0x (like 0x0d0a). Returns false if it is empty.
+	bool parse_pattern(const std::string& in, search::Pattern& pattern)
 	{
-		wclear(main);
-		wclear(menu);
-		if (get_current_document().get_type() != MultipartDocumentType)
+		pattern = search::Pattern();
+		bool hex = in.size() > 2 && in.size() % 2 == 0 && in[0] == '0' && (in[1] == 'x' || in[1] == 'X')
+			&& std::all_of(in.begin() + 2, in.end(), [](char c) { return std::isxdigit((unsigned char)c); });
+		if (hex)
 		{
-			multipart_index = 0;
-			std::string preview = get_current_document().generate_preview(width, height - 1);
-			waddstr(main, preview.c_str());
+			//The bytes also stand for the codepoints of the same value in unicode documents
+			for (size_t i = 2; i < in.size(); i += 2)
+			{
+				unsigned char byte = (unsigned char)std::stoi(in.substr(i, 2), nullptr, 16);
+				pattern.bytes.push_back((char)byte);
+				pattern.text.push_back(byte);
+			}
 		}
 		else {
+			pattern.bytes = in;
+			pattern.text = decode_utf8(in.data(), in.size());
+		}
+		return !pattern.bytes.empty();
+	}
+
+	//Moves the view to the next match of the search pattern (or the previous one if backward),
+	//wrapping around at the end. In a multipart document, highlights the next part containing
+	//a match. A new search starts at the top of the view. Returns false if there is no match.
+	bool find_match(bool backward, bool new_search)
+	{
+		Document& document = get_current_document();
+		bool again = !new_search && &document == search_document;
+		search_document = &document;
+		size_t found = std::string::npos;
+		switch (document.get_type())
+		{
+		case MultipartDocumentType:
+		{
+			MultipartDocument& doc = dynamic_cast<MultipartDocument&>(document);
+			found = search::find_part(doc, search_pattern, multipart_index, backward, search_all_parts);
+			if (found == doc.data.size())
+			{
+				return false;
+			}
+			multipart_index = found;
+			return true;
+		}
+		case OctetDocumentType:
+		{
+			OctetDocument& doc = dynamic_cast<OctetDocument&>(document);
+			size_t start = again ? search_match : octet_view_offset;
+			if (backward)
+			{
+				found = search::rfind(doc.data, search_pattern.bytes, start);
+				found = found != std::string::npos ? found : search::rfind(doc.data, search_pattern.bytes, SIZE_MAX);
+			}
+			else {
+				found = search::find(doc.data, search_pattern.bytes, again ? start + 1 : start);
+				found = found != std::string::npos ? found : search::find(doc.data, search_pattern.bytes, 0);
+			}
+			if (found != std::string::npos)
+			{
+				octet_view_offset = found;
+			}
+			break;
+		}
+		case UnicodeDocumentType:
+		{
+			UnicodeDocument& doc = dynamic_cast<UnicodeDocument&>(document);
+			size_t start = again ? search_match : unicode_view_position;
+			if (backward)
+			{
+				found = search::rfind(doc.data, search_pattern.text, start);
+				found = found != std::string::npos ? found : search::rfind(doc.data, search_pattern.text, SIZE_MAX);
+			}
+			else {
+				found = search::find(doc.data, search_pattern.text, again ? start + 1 : start);
+				found = found != std::string::npos ? found : search::find(doc.data, search_pattern.text, 0);
+			}
+			if (found != std::string::npos)
+			{
+				unicode_view_position = doc.row_start(found, width);
+			}
+			break;
+		}
+		}
+		search_match = found;
+		return found != std::string::npos;
+	}
+
+	void redraw()
+	{
+		if (full_repaint)
+		{
+			wclear(main);
+			wclear(menu);
+			main_shadow.clear();
+			menu_shadow.clear();
+			full_repaint = false;
+		}
+		cells_written = 0;
+		//Editing ends with the document it started on
+		editing = editing && &get_current_document() == edit_document;
+		switch (get_current_document().get_type())
+		{
+		case MultipartDocumentType:
 			draw_multipart();
+			break;
+		case OctetDocumentType:
+			multipart_index = 0;
+			draw_octet();
+			break;
+		case UnicodeDocumentType:
+			multipart_index = 0;
+			draw_unicode();
+			break;
 		}
 
 		draw_menu();
 
+		present(main, main_rows, main_shadow, height - 1);
+		present(menu, menu_rows, menu_shadow, 1);
+		frame_cells = cells_written;
+
 		wmove(main, 0, 0);
 		wmove(menu, 0, 0);
 		wrefresh(main);
@@ -120,6 +934,8 @@ namespace gui
 			delwin(currmenuw);
 			opened_menu = NoneTransformType;
 			currmenuw = NULL;
+			//Let the next refresh bring back what the menu covered
+			touchwin(main);
 		}
 	}
 
@@ -127,16 +943,99 @@ namespace gui
 	{
 		in_error = true;
 		close_menu();
-		wclear(main);
+		werase(main);
+		main_shadow.clear();
 		waddstr(main, "Error:\n");
 		waddstr(main, err);
 		waddstr(main, "\nPress any key to continue.");
 		wrefresh(main);
 	}
 
+	//Fits the windows to the resized terminal
+	void resize()
+	{
+		resize_term(0, 0);
+		getmaxyx(stdscr, height, width);
+		wresize(main, height - 1, width);
+		wresize(menu, 1, width);
+		mvwin(menu, height - 1, 0);
+		close_menu();
+		full_repaint = true;
+	}
+
+	//Draws the progress of a running transform in place of the status bar
+	void draw_progress(const Progress& progress)
+	{
+		if (full_repaint)
+		{
+			//The document is drawn again only once the transform finished
+			wclear(menu);
+			menu_shadow.clear();
+		}
+		size_t done = progress.get_done();
+		size_t total = progress.get_total();
+		double ratio = total ? std::min(1.0, (double)done / total) : 0;
+
+		std::string bar = " Working... " + std::to_string((int)(ratio * 100)) + "% ";
+		std::string cancel = " | ESC CANCEL ";
+		int meter = width - (int)bar.size() - (int)cancel.size() - 2;
+		if (meter > 0)
+		{
+			int filled = (int)(ratio * meter);
+			bar += "[" + std::string(filled, '#') + std::string(meter - filled, ' ') + "]";
+		}
+		bar += cancel;
+		bar.resize(width, ' ');
+		add_text(menu_rows, bar, A_REVERSE);
+
+		present(menu, menu_rows, menu_shadow, 1);
+		wmove(menu, 0, 0);
+		wrefresh(menu);
+	}
+
+	//Runs work on another thread, showing its progress until it is done or ESC
+	//cancels it. The work reads or replaces the current document, so only the
+	//status bar is drawn meanwhile.
+	template<typename Work>
+	auto run_in_background(Work work) -> decltype(work())
+	{
+		close_menu();
+		Progress progress;
+		std::future<decltype(work())> result = std::async(std::launch::async, [&progress, &work]()
+		{
+			Progress::attach(&progress);
+			return work();
+		});
+
+		//Short transforms finish before anything is drawn
+		wtimeout(main, 0);
+		while (result.wait_for(std::chrono::milliseconds(50)) != std::future_status::ready)
+		{
+			draw_progress(progress);
+			int ch = wgetch(main);
+			if (ch == 27 || ch == ctrl('c'))
+			{
+				progress.cancel();
+			}
+			else if (ch == KEY_RESIZE)
+			{
+				resize();
+			}
+		}
+		wtimeout(main, -1);
+
+		//Throws what the work threw, like TransformCancelled
+		return result.get();
+	}
+
+	void run_transform(const Transform* ts)
+	{
+		commit_transform(ts, run_in_background([ts]() { return transform_current(ts); }));
+	}
+
 	void start()
 	{
-		register_transforms();
+		register_menus();
 		
 		std::setlocale(LC_ALL, "en_US.UTF-8"); //necessary to get UTF-8 support
 
@@ -148,9 +1047,10 @@ namespace gui
 
 		getmaxyx(stdscr, height, width);
 
-		main = newwin(height, width, 0, 0);
+		main = newwin(height - 1, width, 0, 0);
 		menu = newwin(1, width, height - 1, 0);
 		keypad(main, TRUE); //Enable special keys
+		set_escdelay(25); //ESC alone cancels transforms, don't wait long for the rest of a sequence
 		wattron(menu, A_REVERSE);
 
 		redraw();
@@ -173,7 +1073,13 @@ namespace gui
 				if (it != opened_menu_keymap.end())
 				{
 					try {
-						apply_transform(it->second);
+						run_transform(it->second);
+					}
+					catch (const TransformCancelled&)
+					{
+						//Nothing changed
+						redraw();
+						continue;
 					}
 					catch (const TransformError& e)
 					{
@@ -187,19 +1093,71 @@ namespace gui
 				}
 			}
 
+			//While editing, keys change the document. Function keys and ctrl-c stop
+			//editing and do what they do otherwise, other keys do nothing.
+			if (editing)
+			{
+				if (edit_key(ch) || (ch < KEY_MIN && ch != ctrl('c')))
+				{
+					close_menu();
+					redraw();
+					continue;
+				}
+				if (ch != KEY_RESIZE)
+				{
+					stop_editing();
+				}
+			}
+
 			//If we are showing a multipart document, handle arrow keys and enter
 			if (get_current_document().get_type() == MultipartDocumentType && multipart_index >= 0)
 			{
 				switch (ch)
 				{
 				case KEY_UP:
-					if (multipart_index > 0) multipart_index--;
-					redraw();
-					break;
+					move_highlight(multipart_index > 0 ? multipart_index - 1 : 0);
+					continue;
 				case KEY_DOWN:
-					if ((size_t)multipart_index < dynamic_cast<MultipartDocument&>(get_current_document()).data.size() - 1) multipart_index++;
+					move_highlight(multipart_index + 1);
+					continue;
+				case KEY_PPAGE:
+					move_highlight(multipart_index > (size_t)(height - 1) ? multipart_index - (height - 1) : 0);
+					continue;
+				case KEY_NPAGE:
+					move_highlight(multipart_index + (height - 1));
+					continue;
+				case KEY_HOME:
+					move_highlight(0);
+					continue;
+				case KEY_END:
+					move_highlight(SIZE_MAX);
+					continue;
+				case 'p':
+					search_all_parts = !search_all_parts;
+					close_menu();
 					redraw();
+					continue;
+				case 'j':
+				{
+					MultipartDocument& doc = dynamic_cast<MultipartDocument&>(get_current_document());
+					std::string in = get_input("Jump to key starting with: ");
+					size_t found;
+					try {
+						found = doc.find_prefix(decode_utf8(in.data(), in.size()), multipart_index);
+					}
+					catch (const TransformError& e)
+					{
+						show_error(e.what());
+						continue;
+					}
+					if (found == doc.data.size())
+					{
+						show_error("No key starts with that");
+						continue;
+					}
+					multipart_index = found;
 					break;
+				}
 				case '\n':
 				case '\r':
 				case KEY_ENTER:
@@ -211,15 +1169,100 @@ namespace gui
 				}
 			}
 
+			//If we are showing an octet document, handle scrolling
+			if (get_current_document().get_type() == OctetDocumentType)
+			{
+				switch (ch)
+				{
+				case KEY_UP:
+					scroll_octet(-1);
+					break;
+				case KEY_DOWN:
+					scroll_octet(1);
+					break;
+				case KEY_PPAGE:
+					scroll_octet(-(height - 1));
+					break;
+				case KEY_NPAGE:
+					scroll_octet(height - 1);
+					break;
+				case KEY_HOME:
+					octet_view_offset = 0;
+					break;
+				case KEY_END:
+					octet_view_offset = SIZE_MAX;
+					break;
+				case 'g':
+				{
+					unsigned long long offset;
+					if (!parse_number(get_input("Go to offset (0x for hex): "), offset))
+					{
+						show_error("Invalid offset");
+						continue;
+					}
+					octet_view_offset = (size_t)offset;
+					break;
+				}
+				case 'e':
+					start_editing();
+					break;
+				}
+			}
+
+			//If we are showing a unicode document, handle scrolling
+			if (get_current_document().get_type() == UnicodeDocumentType)
+			{
+				UnicodeDocument& doc = dynamic_cast<UnicodeDocument&>(get_current_document());
+				switch (ch)
+				{
+				case KEY_UP:
+					scroll_unicode(-1);
+					break;
+				case KEY_DOWN:
+					scroll_unicode(1);
+					break;
+				case KEY_PPAGE:
+					scroll_unicode(-(height - 1));
+					break;
+				case KEY_NPAGE:
+					scroll_unicode(height - 1);
+					break;
+				case KEY_HOME:
+					unicode_view_position = 0;
+					break;
+				case KEY_END:
+					unicode_view_position = doc.row_start(doc.data.size(), width);
+					scroll_unicode(-(height - 2));
+					break;
+				case 'g':
+				{
+					std::string in = get_input("Go to line (or N%): ");
+					bool percent = !in.empty() && in.back() == '%';
+					unsigned long long number;
+					if (!parse_number(percent ? in.substr(0, in.size() - 1) : in, number) || (percent && number > 100))
+					{
+						show_error(percent ? "Invalid percentage" : "Invalid line number");
+						continue;
+					}
+					if (percent)
+					{
+						unicode_view_position = doc.row_start(doc.data.size() / 100 * number + doc.data.size() % 100 * number / 100, width);
+					}
+					else {
+						unicode_view_position = doc.line_start(number > 0 ? (size_t)number - 1 : 0);
+					}
+					break;
+				}
+				case 'e':
+					start_editing();
+					break;
+				}
+			}
+
 			switch (ch)
 			{
 			case KEY_RESIZE:
-				resize_term(0, 0);
-				getmaxyx(stdscr, height, width);
-				wresize(main, height - 1, width);
-				wresize(menu, 1, width);
-				mvwin(menu, height - 1, 0);
-				close_menu();
+				resize();
 				redraw();
 				break;
 			case KEY_F(1):
@@ -231,6 +1274,8 @@ namespace gui
 					noecho(); //Don't echo user input
 					curs_set(FALSE);
 					keypad(main, TRUE); //reenable special keys
+					//The editor drew over the whole screen
+					full_repaint = true;
 					redraw();
 				}
 				catch (const std::exception& e)
@@ -263,7 +1308,13 @@ namespace gui
 			case KEY_F(3):
 				//REENC
 				try {
-					reenc();
+					run_in_background(reenc);
+				}
+				catch (const TransformCancelled&)
+				{
+					//The transforms reversed before ESC stay reversed
+					redraw();
+					continue;
 				}
 				catch (const std::exception& e)
 				{
@@ -290,6 +1341,46 @@ namespace gui
 			case KEY_F(9):
 				open_menu(9);
 				break;
+			case KEY_F(12):
+				show_frame_cells = !show_frame_cells;
+				close_menu();
+				redraw();
+				break;
+			case '/':
+				try {
+					if (!parse_pattern(get_input("Search (0x for hex bytes): "), search_pattern))
+					{
+						redraw();
+						break;
+					}
+				}
+				catch (const TransformError& e)
+				{
+					show_error(e.what());
+					continue;
+				}
+				if (!find_match(false, true))
+				{
+					show_error("Pattern not found");
+					continue;
+				}
+				redraw();
+				break;
+			case 'n':
+			case 'N':
+				if (search_pattern.bytes.empty())
+				{
+					show_error("Nothing was searched for yet");
+					continue;
+				}
+				if (!find_match(ch == 'N', false))
+				{
+					show_error("Pattern not found");
+					continue;
+				}
+				close_menu();
+				redraw();
+				break;
 			case ctrl('c'):
 				goto end;
 				break;
@@ -297,7 +1388,12 @@ namespace gui
 			case KEY_BACKSPACE:
 			case 'b':
 				try {
-					ret_to_parent();
+					run_in_background(ret_to_parent);
+				}
+				catch (const TransformCancelled&)
+				{
+					redraw();
+					continue;
 				}
 				catch (const std::exception& e)
 				{
@@ -331,7 +1427,7 @@ namespace gui
 			redraw();
 			size_t maxlength = 0;
 			size_t count = 0;
-			for (auto&& a : availableTransforms[opened_menu])
+			for (auto&& a : registry::get_transforms(opened_menu))
 			{
 				if (a->accepts_type(get_current_document().get_type()))
 				{
@@ -347,7 +1443,7 @@ namespace gui
 			wattron(currmenuw, A_REVERSE);
 			opened_menu_keymap.clear();
 			char i = '1';
-			for (auto&& a : availableTransforms[opened_menu])
+			for (auto&& a : registry::get_transforms(opened_menu))
 			{
 				if (a->accepts_type(get_current_document().get_type()))
 				{
@@ -366,77 +1462,87 @@ namespace gui
 		}
 	}
 
-	void register_transforms()
+	void register_menus()
 	{
-		availableTransforms[DecodeTransformType].push_back(std::make_unique<Base64Decode>());
-		availableTransforms[DecodeTransformType].push_back(std::make_unique<UTF8Decode>());
-		availableTransforms[DecodeTransformType].push_back(std::make_unique<xwwwformurlencodedDecode>());
-		availableTransforms[EncodeTransformType].push_back(std::make_unique<Base64Encode>());
-		availableTransforms[EncodeTransformType].push_back(std::make_unique<UTF8Encode>());
-		availableTransforms[EncodeTransformType].push_back(std::make_unique<xwwwformurlencodedEncode>());
-
 		menus_keymap[4] = DecodeTransformType;
 		menus_keymap[5] = EncodeTransformType;
 	}
 
 	void draw_menu()
 	{
-		int x;
-
-		if (has_parent())
+		//Everything is written in reverse, except for the opened menu
+		std::string bar = has_parent() ? "< " : "  ";
+		if (editing)
 		{
-			waddstr(menu, "< ");
+			bar += " (editing)  ";
 		}
 		else {
-			waddstr(menu, "  ");
-		}
-		switch (get_current_document().get_type())
-		{
-		case UnicodeDocumentType:
-			waddstr(menu, " (unicode)  ");
-			break;
-		case OctetDocumentType:
-			waddstr(menu, "  (octet)   ");
-			break;
-		case MultipartDocumentType:
-			waddstr(menu, "(multipart) ");
-			break;
+			switch (get_current_document().get_type())
+			{
+			case UnicodeDocumentType:
+				bar += " (unicode)  ";
+				break;
+			case OctetDocumentType:
+				bar += "  (octet)   ";
+				break;
+			case MultipartDocumentType:
+				bar += "(multipart) ";
+				break;
+			}
 		}
 
-		waddstr(menu, "| F1 EDIT | F2 SAVE | F3 REENC ");
+		bar += "| F1 EDIT | F2 SAVE | F3 REENC ";
+		size_t written = 0;
 		for (auto&& a : menus_keymap)
 		{
 			if (a.second == opened_menu)
 			{
-				wattroff(menu, A_REVERSE);
+				add_text(menu_rows, bar, A_REVERSE);
+				written += bar.size();
+				bar.clear();
 			}
-			x = getcurx(menu);
-			menus_position[a.second] = x + 1;
-			waddstr(menu, "| F");
-			wprintw(menu, "%d", a.first);
-			waddstr(menu, " ");
+			menus_position[a.second] = written + bar.size() + 1;
+			std::string item = "| F" + std::to_string((int)a.first) + " ";
 			switch (a.second)
 			{
 			case EncodeTransformType:
-				waddstr(menu, "ENCODE");
+				item += "ENCODE";
 				break;
 			case DecodeTransformType:
-				waddstr(menu, "DECODE");
+				item += "DECODE";
 				break;
 			default:
-				waddstr(menu, "ERROR");
+				item += "ERROR";
 				break;
 			}
-			waddstr(menu, " ");
-			wattron(menu, A_REVERSE);
+			item += " ";
+			if (a.second == opened_menu)
+			{
+				add_text(menu_rows, item);
+				written += item.size();
+			}
+			else {
+				bar += item;
+			}
 		}
 
-		x = getcurx(menu);
-		for (int i = x; i < width; i++)
+		if (search_all_parts && get_current_document().get_type() == MultipartDocumentType)
 		{
-			waddch(menu, ' ');
+			bar += "| p SEARCH ALL PARTS ";
 		}
-
+		if (written + bar.size() < (size_t)width)
+		{
+			bar.append(width - written - bar.size(), ' ');
+		}
+		if (show_frame_cells)
+		{
+			//Over the right end of the bar, so it stays visible
+			std::string cells = "| " + std::to_string(frame_cells) + " cells ";
+			size_t end = std::min(bar.size(), (size_t)std::max(0, width - (int)written));
+			size_t start = end > cells.size() ? end - cells.size() : 0;
+			bar.replace(start, end - start, cells.substr(0, end - start));
+		}
+		add_text(menu_rows, bar, A_REVERSE);
 	}
 
 	std::string get_input(const std::string& message)
@@ -447,7 +1553,8 @@ namespace gui
 		//At least it's only local and we only use it locally with wgetnstr which *should* be secure
 		char buffer[1024];
 
-		wclear(main);
+		werase(main);
+		main_shadow.clear();
 		waddstr(main, message.c_str());
 		wrefresh(main);
 		wgetnstr(main, buffer, 1020); //4 bytes larger just in case ncurses has some nasty off-by-ones
@@ -0,0 +1,32 @@
+#include "key_index.h"
+
+void KeyIndex::insert_slot(size_t hash, size_t position)
+{
+	size_t mask = slots.size() - 1;
+	size_t i = hash & mask;
+	while (slots[i].position != 0)
+	{
+		i = (i + 1) & mask;
+	}
+	slots[i].hash = hash;
+	slots[i].position = position + 1;
+}
+
+void KeyIndex::insert(size_t hash, size_t position)
+{
+	//Keep at most half of the slots used, so probe sequences stay short
+	if ((count + 1) * 2 > slots.size())
+	{
+		std::vector<Slot> old(slots.size() < 16 ? 16 : slots.size() * 2, Slot{ 0, 0 });
+		old.swap(slots);
+		for (auto&& slot : old)
+		{
+			if (slot.position != 0)
+			{
+				insert_slot(slot.hash, slot.position - 1);
+			}
+		}
+	}
+	insert_slot(hash, position);
+	count++;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+//Open-addressing hash table of positions (of multipart parts), looked up by the
+//hash of their key. Positions with the same hash, like those of duplicate keys,
+//are all kept, so callers compare the keys themselves.
+class KeyIndex
+{
+	struct Slot
+	{
+		size_t hash;
+		//One past the position, 0 marks an empty slot
+		size_t position;
+	};
+	std::vector<Slot> slots;
+	size_t count = 0;
+
+	void insert_slot(size_t hash, size_t position);
+public:
+	//Number of positions inserted
+	size_t size() const { return count; }
+	size_t memory_usage() const { return slots.size() * sizeof(Slot); }
+
+	void insert(size_t hash, size_t position);
+
+	//Calls f(position) for every position inserted with the hash
+	template <typename function>
+	void find(size_t hash, function&& f) const
+	{
+		if (slots.empty())
+		{
+			return;
+		}
+		size_t mask = slots.size() - 1;
+		for (size_t i = hash & mask; slots[i].position != 0; i = (i + 1) & mask)
+		{
+			if (slots[i].hash == hash)
+			{
+				f(slots[i].position - 1);
+			}
+		}
+	}
+};
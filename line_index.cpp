@@ -0,0 +1,64 @@
+#include "line_index.h"
+
+#include <algorithm>
+
+#include "utf8_charclass.h"
+
+//Codepoints searched at once when more lines are needed
+static const size_t chunk_size = 64 * 1024;
+
+void LineIndex::scan(const UnicodeString& text, size_t position)
+{
+	size_t until = position >= text.size() ? text.size() : std::min(text.size(), std::max(position + 1, scanned + chunk_size));
+	if (scanned >= until)
+	{
+		return;
+	}
+	//Reads around the gap an edit left, so scanning after an edit doesn't move the text
+	text.visit_runs(scanned, until - scanned, [&](auto begin, auto end, size_t first) {
+		for (size_t i = first; i < first + (end - begin); i++)
+		{
+			if (!utf8::is_newline(begin[i - first]))
+			{
+				continue;
+			}
+			//The LF of CR LF moves the start of the line the CR began
+			if (begin[i - first] == 0xA && i > 0 && text[i - 1] == 0xD && starts.back() == i)
+			{
+				starts.back() = i + 1;
+			}
+			else {
+				starts.push_back(i + 1);
+			}
+		}
+	});
+	scanned = until;
+}
+
+void LineIndex::invalidate(size_t position)
+{
+	//A line starting at position depends on whether the codepoint there is the LF of CR LF
+	starts.resize(std::max((size_t)1, (size_t)(std::lower_bound(starts.begin(), starts.end(), position) - starts.begin())));
+	scanned = std::min(scanned, starts.back());
+}
+
+size_t LineIndex::line_of(const UnicodeString& text, size_t position)
+{
+	scan(text, position);
+	return std::upper_bound(starts.begin(), starts.end(), position) - starts.begin() - 1;
+}
+
+size_t LineIndex::line_start(const UnicodeString& text, size_t line)
+{
+	while (starts.size() <= line && scanned < text.size())
+	{
+		scan(text, scanned);
+	}
+	return starts[std::min(line, starts.size() - 1)];
+}
+
+size_t LineIndex::line_count(const UnicodeString& text)
+{
+	scan(text, text.size());
+	return starts.size();
+}
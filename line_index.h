@@ -0,0 +1,34 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+#include "unicode_string.h"
+
+//Start positions of the lines of a text, found chunk by chunk only as far as
+//they were asked for. Lines end with any newline character, and CR LF ends
+//a single line.
+class LineIndex
+{
+	//Always starts with the first line at 0
+	std::vector<size_t> starts;
+	//Number of codepoints searched for newlines so far
+	size_t scanned = 0;
+
+	//Searches the text at least up to position (or to its end)
+	void scan(const UnicodeString& text, size_t position);
+public:
+	LineIndex() : starts(1, 0) {}
+
+	//Forgets the lines that start past position, for texts that changed there
+	void invalidate(size_t position);
+
+	//Returns the number of the line containing the position
+	size_t line_of(const UnicodeString& text, size_t position);
+	//Returns the start of the line, or of the last one if there are fewer lines
+	size_t line_start(const UnicodeString& text, size_t line);
+	//Returns the number of lines, which searches the whole text
+	size_t line_count(const UnicodeString& text);
+
+	size_t memory_usage() const { return starts.capacity() * sizeof(size_t); }
+};
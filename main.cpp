@@ -19,19 +19,44 @@
 
 
 #include "gui.h"
+#include "cli.h"
 #include "document.h"
 #include "transform.h"
 
 
 //local functions declarations
 void usage(const char * arg0);
-bool is_valid_utf8_file(const std::istream& file_name);
 
-std::stack<const Transform*> transformation_history;
+//A transform that was applied to get the current document, together with
+//a snapshot of the document it was applied to
+struct HistoryEntry
+{
+	const Transform* transform;
+	//The document before the transform, nullptr if there is none or it was evicted
+	std::unique_ptr<Document> snapshot;
+	size_t snapshot_size;
+	//Generation of the result of the transform, the snapshot is only
+	//used to go back while the result is unchanged
+	unsigned long result_generation;
+};
+
+std::vector<HistoryEntry> transformation_history;
+
+//Memory used by all snapshots in transformation_history
+size_t snapshot_memory = 0;
+
+//A multipart document one of whose parts is being worked on
+struct ParentEntry
+{
+	std::unique_ptr<Document> document;
+	//The position of the part in the parent, whose entry stays there checked out
+	size_t index;
+	//Generation of the part when it was selected
+	unsigned long part_generation;
+};
 
 //Contains a hierarchy of current document's multipart parents
-//The std::vector<utf8::uint32_t> is the string key under which the current document was known to the parent
-std::stack < std::pair<std::unique_ptr<Document>, std::vector<utf8::uint32_t>>> parents;
+std::stack<ParentEntry> parents;
 
 std::unique_ptr<Document> current;
 std::string current_filename = "";
@@ -43,9 +68,17 @@ public:
 	bool reverse_transform() const final { return false; };
 	std::unique_ptr<Transform> get_reverse_transform() const final { throw std::logic_error("Can't reverse pushback"); };
 	std::unique_ptr<Document> transform(const Document& input) const final {
-		std::unique_ptr<Document> doc = std::move(parents.top().first);
+		ParentEntry& parent = parents.top();
+		std::unique_ptr<Document> doc = std::move(parent.document);
 		MultipartDocument& multidoc = dynamic_cast<MultipartDocument &>(*doc);
-		multidoc.data.push_back(make_pair(parents.top().second, std::move(current)));
+		MultipartEntry& part = multidoc.data[parent.index];
+		if (current->get_generation() != parent.part_generation)
+		{
+			part.dirty = true;
+			doc->mark_dirty();
+		}
+		part.document = std::move(current);
+		part.checked_out = false;
 		parents.pop();
 		return doc;
 	};
@@ -65,9 +98,14 @@ public:
 		}
 		MultipartDocument& multidoc = dynamic_cast<MultipartDocument&>(*current);
 		size_t index = gui::get_highlighted_index();
-		std::unique_ptr<Document> selected = std::move(multidoc.data[index].second);
-		parents.push(make_pair(std::move(current), std::move(multidoc.data[index].first)));
-		multidoc.data.erase(multidoc.data.begin() + index);
+		MultipartEntry& part = multidoc.get_part(index);
+		std::unique_ptr<Document> selected = std::move(part.document);
+		part.checked_out = true;
+		ParentEntry parent;
+		parent.index = index;
+		parent.part_generation = selected->get_generation();
+		parent.document = std::move(current);
+		parents.push(std::move(parent));
 		return selected;
 	};
 	const std::string get_description() const final { return "SelectPart"; };
@@ -78,6 +116,11 @@ SelectPart select_transform;
 
 int main(int argc, char* argv[])
 {
+	if (cli::is_requested(argc, argv))
+	{
+		return cli::run(argc, argv);
+	}
+
 	if (argc > 2)
 	{
 		usage(argv[0]);
@@ -109,22 +152,28 @@ int main(int argc, char* argv[])
 			goto start;
 		}
 #endif
-		std::ifstream input(current_filename, std::ios::binary);
-		if (!input)
+		std::unique_ptr<OctetDocument> octets = std::make_unique<OctetDocument>();
+		//Regular files are mapped, everything else (pipes, devices...) is read into memory
+		if (!octets->data.map_file(current_filename))
 		{
-			std::cerr << "Failed to open file " << argv[1] << "!";
-			return 1;
+			std::ifstream input(current_filename, std::ios::binary);
+			if (!input)
+			{
+				std::cerr << "Failed to open file " << argv[1] << "!";
+				return 1;
+			}
+			octets->do_import(input);
+			input.close();
 		}
-		if (is_valid_utf8_file(input))
-		{
-			current = std::make_unique<UnicodeDocument>();
+		//UTF-8 decoding validates the whole file before decoding anything,
+		//so a file that turns out to be binary is only scanned up to the first invalid sequence
+		try {
+			current = UTF8Decode().transform(*octets);
 		}
-		else {
-			current = std::make_unique<OctetDocument>();
+		catch (const TransformError&)
+		{
+			current = std::move(octets);
 		}
-		input.seekg(0, std::ios_base::beg);
-		current->do_import(input);
-		input.close();
 	}
 start:
 	gui::start();
@@ -133,7 +182,8 @@ start:
 
 void usage(const char* arg0)
 {
-	std::cout << "Usage: " << arg0 << " [filename]" << std::endl;
+	std::cout << "Usage: " << arg0 << " [filename]" << std::endl
+		<< "       " << arg0 << " --help (for the non-interactive mode)" << std::endl;
 }
 
 Document& get_current_document()
@@ -173,7 +223,7 @@ void run_editor()
 	{
 		throw std::logic_error("Failed to read back TMP file");
 	}
-	current->do_import(in);
+	current->do_reimport(in);
 	in.close();
 
 	std::remove(tmpname.str().c_str());
@@ -185,18 +235,55 @@ std::string get_current_filename()
 	return current_filename;
 }
 
-void apply_transform(const Transform* ts)
+//Returns the maximum memory used by snapshots, which can be set in MiB
+//by the GENCODER_SNAPSHOT_LIMIT environment variable
+static size_t snapshot_limit()
 {
-	current = ts->transform(*current);
-	transformation_history.push(ts);
+	static const size_t limit = getenv("GENCODER_SNAPSHOT_LIMIT") != NULL ?
+		(size_t)strtoull(getenv("GENCODER_SNAPSHOT_LIMIT"), NULL, 10) << 20 : (size_t)256 << 20;
+	return limit;
 }
 
-bool is_valid_utf8_file(const std::istream& in)
+//Drops the oldest snapshots until they fit into the limit
+static void evict_snapshots()
 {
-	std::istreambuf_iterator<char> it(in.rdbuf());
-	std::istreambuf_iterator<char> eos;
+	for (auto&& entry : transformation_history)
+	{
+		if (snapshot_memory <= snapshot_limit())
+		{
+			break;
+		}
+		if (entry.snapshot)
+		{
+			snapshot_memory -= entry.snapshot_size;
+			entry.snapshot.reset();
+		}
+	}
+}
+
+std::unique_ptr<Document> transform_current(const Transform* ts)
+{
+	return ts->transform(*current);
+}
+
+void commit_transform(const Transform* ts, std::unique_ptr<Document> result)
+{
+	HistoryEntry entry;
+	entry.transform = ts;
+	entry.result_generation = result->get_generation();
+	//Some transforms (selecting a part) take the document over themselves
+	entry.snapshot = std::move(current);
+	entry.snapshot_size = entry.snapshot ? entry.snapshot->memory_usage() : 0;
+	snapshot_memory += entry.snapshot_size;
+	transformation_history.push_back(std::move(entry));
+	evict_snapshots();
+
+	current = std::move(result);
+}
 
-	return utf8::is_valid(it, eos);
+void apply_transform(const Transform* ts)
+{
+	commit_transform(ts, transform_current(ts));
 }
 
 void save_current(std::string filename)
@@ -230,12 +317,34 @@ void pop_history()
 {
 	if (!transformation_history.empty())
 	{
-		if (transformation_history.top()->reverse_transform())
+		HistoryEntry& entry = transformation_history.back();
+		if (entry.transform->reverse_transform())
+		{
+			if (entry.snapshot && entry.result_generation == current->get_generation())
+			{
+				snapshot_memory -= entry.snapshot_size;
+				current = std::move(entry.snapshot);
+			}
+			else if (entry.snapshot && current->is_dirty())
+			{
+				//Only the modified part needs to be encoded again. If this is cancelled
+				//the snapshot is gone and the entry is later reversed in full.
+				snapshot_memory -= entry.snapshot_size;
+				std::unique_ptr<Transform> t = entry.transform->get_reverse_transform();
+				current = t->transform_incremental(*current, std::move(entry.snapshot));
+			}
+			else {
+				std::unique_ptr<Transform> t = entry.transform->get_reverse_transform();
+				current = t->transform(*current);
+			}
+		}
+		//Only reached if the reverse transform finished, so a cancelled one
+		//leaves the entry and the current document as they were
+		if (entry.snapshot)
 		{
-			std::unique_ptr<Transform> t = transformation_history.top()->get_reverse_transform();
-			current = t->transform(*current);
+			snapshot_memory -= entry.snapshot_size;
 		}
-		transformation_history.pop();
+		transformation_history.pop_back();
 	}
 }
 
@@ -7,12 +7,19 @@ Document& get_current_document();
 std::string get_current_filename();
 
 void apply_transform(const Transform* ts);
+//The two halves of apply_transform: the first only reads the current document
+//(so it can run on another thread), the second makes its result current
+std::unique_ptr<Document> transform_current(const Transform* ts);
+void commit_transform(const Transform* ts, std::unique_ptr<Document> result);
 
 void run_editor();
 void save_current(std::string filename);
 
 bool has_parent();
 void select_part();
+//Reverse the transforms of the history one at a time, replacing the current
+//document after each, so they can run on another thread while the UI only
+//shows progress. Cancelling stops at the transform being reversed.
 void ret_to_parent();
 void reenc();
 
@@ -0,0 +1,276 @@
+#include "octet_buffer.h"
+
+#include <algorithm>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//Owns a private read-write mapping of a whole file
+class MappedFile
+{
+public:
+	char* address;
+	size_t length;
+
+	MappedFile(char* address, size_t length) : address(address), length(length)
+	{
+
+	}
+
+	~MappedFile()
+	{
+#ifndef _WIN32
+		munmap(address, length);
+#endif
+	}
+};
+
+bool OctetBuffer::map_file(const std::string& filename)
+{
+#ifdef _WIN32
+	return false;
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		close(fd);
+		return false;
+	}
+
+	size_t length = (size_t)st.st_size;
+	if (length == 0)
+	{
+		//Zero-length mappings are not allowed
+		close(fd);
+		clear();
+		return true;
+	}
+
+	//MAP_PRIVATE makes writes copy-on-write, so the file itself is never modified
+	void* address = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (address == MAP_FAILED)
+	{
+		return false;
+	}
+
+	clear();
+	std::vector<char, uninitialized_allocator<char>>().swap(owned);
+	mapping = std::make_shared<MappedFile>((char*)address, length);
+	return true;
+#endif
+}
+
+void OctetBuffer::detach()
+{
+	std::vector<char, uninitialized_allocator<char>> copy(mapping->address, mapping->address + mapping->length);
+	owned.swap(copy);
+	mapping.reset();
+}
+
+void OctetBuffer::flatten() const
+{
+	if (pieces.empty())
+	{
+		return;
+	}
+	std::vector<char, uninitialized_allocator<char>> flat(length);
+	char* out = flat.data();
+	visit(0, length, [&](const char* first, const char* last) {
+		out = std::copy(first, last, out);
+	});
+	owned.swap(flat);
+	mapping.reset();
+	pieces.clear();
+	std::vector<char, uninitialized_allocator<char>>().swap(added);
+}
+
+const char* OctetBuffer::flat_data() const
+{
+	if (mapping)
+	{
+		return mapping->address;
+	}
+	return owned.data();
+}
+
+size_t OctetBuffer::flat_size() const
+{
+	if (mapping)
+	{
+		return mapping->length;
+	}
+	return owned.size();
+}
+
+size_t OctetBuffer::find_piece(size_t pos) const
+{
+	return std::upper_bound(pieces.begin(), pieces.end(), pos, [](size_t pos, const Piece& piece)
+	{
+		return pos < piece.start;
+	}) - pieces.begin() - 1;
+}
+
+const char* OctetBuffer::piece_data(const Piece& piece) const
+{
+	return (piece.added ? added.data() : flat_data()) + piece.offset;
+}
+
+const char* OctetBuffer::data() const
+{
+	flatten();
+	return flat_data();
+}
+
+char* OctetBuffer::mutable_data()
+{
+	flatten();
+	return const_cast<char*>(flat_data());
+}
+
+size_t OctetBuffer::size() const
+{
+	return pieces.empty() ? flat_size() : length;
+}
+
+char OctetBuffer::operator[](size_t pos) const
+{
+	if (pieces.empty())
+	{
+		return flat_data()[pos];
+	}
+	const Piece& piece = pieces[find_piece(pos)];
+	return piece_data(piece)[pos - piece.start];
+}
+
+void OctetBuffer::append(const char* bytes, size_t count)
+{
+	if (mapping || !pieces.empty())
+	{
+		replace(size(), 0, bytes, count);
+		return;
+	}
+	owned.insert(owned.end(), bytes, bytes + count);
+}
+
+void OctetBuffer::replace(size_t pos, size_t count, const char* bytes, size_t n)
+{
+	if (n == count)
+	{
+		//Both the original storage and the added bytes are written in place
+		for (size_t i = pieces.empty() ? 0 : find_piece(pos); n > 0; i++)
+		{
+			char* first = const_cast<char*>(pieces.empty() ? flat_data() + pos : piece_data(pieces[i]) + (pos - pieces[i].start));
+			size_t run = pieces.empty() ? n : std::min(n, pieces[i].start + pieces[i].length - pos);
+			std::copy(bytes, bytes + run, first);
+			bytes += run;
+			pos += run;
+			n -= run;
+		}
+		return;
+	}
+	if (pieces.empty())
+	{
+		length = flat_size();
+		if (length > 0)
+		{
+			pieces.push_back(Piece{ false, 0, length, 0 });
+		}
+	}
+
+	//Split the piece containing pos, so that the edit starts at a piece
+	size_t i = pos < length ? find_piece(pos) : pieces.size();
+	if (i < pieces.size() && pieces[i].start < pos)
+	{
+		Piece rest = pieces[i];
+		size_t before = pos - rest.start;
+		pieces[i].length = before;
+		rest.offset += before;
+		rest.length -= before;
+		rest.start = pos;
+		pieces.insert(pieces.begin() + ++i, rest);
+	}
+
+	//Drop the pieces removed whole and cut the front off the one the removal ends in
+	size_t removed = i;
+	for (size_t remaining = count; remaining > 0; )
+	{
+		Piece& piece = pieces[removed];
+		if (piece.length <= remaining)
+		{
+			remaining -= piece.length;
+			removed++;
+		}
+		else {
+			piece.offset += remaining;
+			piece.length -= remaining;
+			remaining = 0;
+		}
+	}
+	pieces.erase(pieces.begin() + i, pieces.begin() + removed);
+
+	if (n > 0)
+	{
+		//Typing one byte after the other keeps growing the same piece
+		if (i > 0 && pieces[i - 1].added && pieces[i - 1].offset + pieces[i - 1].length == added.size())
+		{
+			pieces[i - 1].length += n;
+		}
+		else {
+			pieces.insert(pieces.begin() + i, Piece{ true, added.size(), n, pos });
+			i++;
+		}
+		added.insert(added.end(), bytes, bytes + n);
+	}
+
+	length = length - count + n;
+	if (pieces.empty())
+	{
+		//Everything was deleted
+		clear();
+		return;
+	}
+	for (size_t start = i > 0 ? pieces[i - 1].start + pieces[i - 1].length : 0; i < pieces.size(); i++)
+	{
+		pieces[i].start = start;
+		start += pieces[i].length;
+	}
+}
+
+void OctetBuffer::resize(size_t count)
+{
+	flatten();
+	if (mapping)
+	{
+		detach();
+	}
+	owned.resize(count);
+}
+
+void OctetBuffer::reserve(size_t count)
+{
+	flatten();
+	if (mapping)
+	{
+		detach();
+	}
+	owned.reserve(count);
+}
+
+void OctetBuffer::clear()
+{
+	mapping.reset();
+	owned.clear();
+	pieces.clear();
+	std::vector<char, uninitialized_allocator<char>>().swap(added);
+	length = 0;
+}
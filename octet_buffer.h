@@ -0,0 +1,114 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <cstddef>
+
+#include "uninitialized_allocator.h"
+
+class MappedFile;
+
+//Sequence of bytes that is either stored in its own heap memory or backed by a
+//private memory mapping of a file.
+//Mappings are never written back to the file: modifying a byte in place only makes
+//the kernel copy the touched page. Inserting and deleting leave that storage as it is
+//and keep the contents as a table of pieces of it and of a buffer of added bytes, so
+//an edit takes time in the bytes inserted and the number of pieces, not in the size.
+//data() puts the pieces back together in heap memory, visit() and operator[] read
+//them where they are.
+class OctetBuffer
+{
+	//Range of the original storage, or of added if added is set
+	struct Piece
+	{
+		bool added;
+		size_t offset;
+		size_t length;
+		//Position of the first byte in the contents
+		size_t start;
+	};
+
+	mutable std::vector<char, uninitialized_allocator<char>> owned;
+	mutable std::shared_ptr<MappedFile> mapping;
+	//Empty until an edit changes the size
+	mutable std::vector<Piece> pieces;
+	mutable std::vector<char, uninitialized_allocator<char>> added;
+	//Size of the contents while there are pieces
+	size_t length = 0;
+
+	//Moves the contents of a mapping to owned memory
+	void detach();
+	//Copies the pieces to owned memory, dropping the mapping
+	void flatten() const;
+	//The original storage, which is all of the contents while there are no pieces
+	const char* flat_data() const;
+	size_t flat_size() const;
+	//Index of the piece containing pos
+	size_t find_piece(size_t pos) const;
+	const char* piece_data(const Piece& piece) const;
+public:
+	typedef char value_type;
+	typedef const char* const_iterator;
+
+	OctetBuffer() = default;
+	//Copies would share a writable mapping, so that a byte modified in one shows up in all
+	OctetBuffer(const OctetBuffer&) = delete;
+	OctetBuffer& operator=(const OctetBuffer&) = delete;
+	OctetBuffer(OctetBuffer&&) = default;
+	OctetBuffer& operator=(OctetBuffer&&) = default;
+
+	//Replaces the contents with a mapping of the supplied file.
+	//Returns false if the file is not a regular file that can be mapped.
+	bool map_file(const std::string& filename);
+	bool is_mapped() const { return mapping != nullptr; }
+	//Returns the number of bytes held in heap memory, a mapping is backed by the page cache
+	size_t memory_usage() const { return owned.size() + added.size(); }
+
+	//Pointer to the contents in one piece of memory, which copies them there after edits
+	//that changed the size
+	const char* data() const;
+	//Pointer for in-place modification, valid until the size changes
+	char* mutable_data();
+	size_t size() const;
+	bool empty() const { return size() == 0; }
+
+	const char* begin() const { return data(); }
+	const char* end() const { return data() + size(); }
+	char operator[](size_t pos) const;
+
+	//Calls f(begin, end) for every contiguous run of the count bytes from pos on, in
+	//order, without putting the pieces together
+	template <typename function>
+	void visit(size_t pos, size_t count, function&& f) const
+	{
+		if (pieces.empty())
+		{
+			f(flat_data() + pos, flat_data() + pos + count);
+			return;
+		}
+		for (size_t i = find_piece(pos); count > 0; i++)
+		{
+			const Piece& piece = pieces[i];
+			size_t run = std::min(count, piece.start + piece.length - pos);
+			const char* first = piece_data(piece) + (pos - piece.start);
+			f(first, first + run);
+			pos += run;
+			count -= run;
+		}
+	}
+
+	void push_back(char c)
+	{
+		append(&c, 1);
+	}
+	void append(const char* bytes, size_t count);
+	//Replaces count bytes at pos with n new bytes. Replacing with the same number of
+	//bytes writes them in place, which only copies the touched pages of a mapping.
+	void replace(size_t pos, size_t count, const char* bytes, size_t n);
+	//New bytes are left uninitialized
+	void resize(size_t count);
+	void reserve(size_t count);
+	void clear();
+};
@@ -0,0 +1,22 @@
+#include "progress.h"
+
+static thread_local Progress* attached = nullptr;
+
+void Progress::attach(Progress* progress)
+{
+	attached = progress;
+}
+
+void report_progress(size_t done, size_t total)
+{
+	if (attached == nullptr)
+	{
+		return;
+	}
+	attached->done.store(done, std::memory_order_relaxed);
+	attached->total.store(total, std::memory_order_relaxed);
+	if (attached->is_cancelled())
+	{
+		throw TransformCancelled();
+	}
+}
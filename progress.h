@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <stdexcept>
+
+//Thrown by report_progress once the work reporting it was cancelled
+class TransformCancelled : public std::runtime_error
+{
+public:
+	TransformCancelled() : runtime_error("Cancelled")
+	{
+
+	}
+};
+
+//Progress of work (like a transform) running on another thread, shared with the thread
+//waiting for it. The loops of the work report how much of their input they processed,
+//which is also where they stop if they were cancelled.
+class Progress
+{
+	std::atomic<size_t> done{ 0 };
+	std::atomic<size_t> total{ 0 };
+	std::atomic<bool> cancelled{ false };
+
+	friend void report_progress(size_t done, size_t total);
+public:
+	size_t get_done() const { return done.load(std::memory_order_relaxed); }
+	size_t get_total() const { return total.load(std::memory_order_relaxed); }
+
+	//Makes the work stop at its next report
+	void cancel() { cancelled.store(true, std::memory_order_relaxed); }
+	bool is_cancelled() const { return cancelled.load(std::memory_order_relaxed); }
+
+	//Sends the progress reported on the calling thread to progress, nullptr stops it
+	static void attach(Progress* progress);
+};
+
+//Number of elements (bytes, codepoints) loops process between two reports
+const size_t progress_block = 1 << 20;
+
+//Reports that done of total elements were processed by the work running on this thread,
+//if there is a Progress attached to it. Throws TransformCancelled if the work was cancelled.
+void report_progress(size_t done, size_t total);
@@ -0,0 +1,67 @@
+#include "registry.h"
+
+#include <map>
+
+namespace registry
+{
+	struct Registry
+	{
+		std::map<TransformType, std::vector<std::unique_ptr<Transform>>> transforms;
+		std::map<TransformType, std::vector<std::string>> names;
+
+		void add(TransformType type, const std::string& name, std::unique_ptr<Transform> transform)
+		{
+			transforms[type].push_back(std::move(transform));
+			names[type].push_back(name);
+		}
+
+		Registry()
+		{
+			add(DecodeTransformType, "base64", std::make_unique<Base64Decode>());
+			add(DecodeTransformType, "utf8", std::make_unique<UTF8Decode>());
+			add(DecodeTransformType, "url", std::make_unique<xwwwformurlencodedDecode>());
+			add(EncodeTransformType, "base64", std::make_unique<Base64Encode>());
+			add(EncodeTransformType, "utf8", std::make_unique<UTF8Encode>());
+			add(EncodeTransformType, "url", std::make_unique<xwwwformurlencodedEncode>());
+		}
+	};
+
+	static Registry& get_registry()
+	{
+		static Registry instance;
+		return instance;
+	}
+
+	const std::vector<std::unique_ptr<Transform>>& get_transforms(TransformType type)
+	{
+		return get_registry().transforms[type];
+	}
+
+	const Transform* find_transform(TransformType type, const std::string& name)
+	{
+		Registry& r = get_registry();
+		std::vector<std::string>& names = r.names[type];
+		for (size_t i = 0; i < names.size(); i++)
+		{
+			if (names[i] == name)
+			{
+				return r.transforms[type][i].get();
+			}
+		}
+		return nullptr;
+	}
+
+	std::string list_names(TransformType type)
+	{
+		std::string result;
+		for (auto&& name : get_registry().names[type])
+		{
+			if (!result.empty())
+			{
+				result += ", ";
+			}
+			result += name;
+		}
+		return result;
+	}
+}
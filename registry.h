@@ -0,0 +1,21 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <string>
+
+#include "transform.h"
+
+//Transforms available in the application, shared by the gui menus and the command line
+namespace registry
+{
+	//Returns the transforms of the type in the order they appear in menus
+	const std::vector<std::unique_ptr<Transform>>& get_transforms(TransformType type);
+
+	//Returns the transform of the type registered under the command line name,
+	//or nullptr if there is none
+	const Transform* find_transform(TransformType type, const std::string& name);
+
+	//Returns the command line names of the transforms of the type, separated by commas
+	std::string list_names(TransformType type);
+}
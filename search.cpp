@@ -0,0 +1,529 @@
+#include "search.h"
+
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "simd.h"
+
+static const size_t npos = std::string::npos;
+
+//Returns whether the pattern is at the position, given its first and last element already matched
+template <typename T>
+static bool matches_inside(const T* data, size_t position, const T* pattern, size_t length)
+{
+	return length < 3 || std::equal(pattern + 1, pattern + length - 1, data + position + 1);
+}
+
+template <typename T>
+static bool matches_at(const T* data, size_t position, const T* pattern, size_t length)
+{
+	return data[position] == pattern[0] && data[position + length - 1] == pattern[length - 1]
+		&& matches_inside(data, position, pattern, length);
+}
+
+//Checks every position from from up to the last one the pattern fits at
+template <typename T>
+static size_t find_scalar(const T* data, size_t size, const T* pattern, size_t length, size_t from)
+{
+	for (size_t i = from; i + length <= size; i++)
+	{
+		if (matches_at(data, i, pattern, length))
+		{
+			return i;
+		}
+	}
+	return npos;
+}
+
+//Checks every position before end, last to first
+template <typename T>
+static size_t rfind_scalar(const T* data, const T* pattern, size_t length, size_t end)
+{
+	for (size_t i = end; i-- > 0;)
+	{
+		if (matches_at(data, i, pattern, length))
+		{
+			return i;
+		}
+	}
+	return npos;
+}
+
+#ifdef SIMD_X86
+
+//The kernels are the generic SIMD algorithm from Wojciech Muła
+//(http://0x80.pl/articles/simd-strfind.html): a vector of positions is compared at
+//once with the first and the last element of the pattern, and only the positions
+//where both match are compared whole. Elements are bytes or stored codepoints.
+
+SIMD_TARGET("avx2")
+static inline __m256i broadcast(std::uint8_t value) { return _mm256_set1_epi8((char)value); }
+SIMD_TARGET("avx2")
+static inline __m256i broadcast(std::uint16_t value) { return _mm256_set1_epi16((short)value); }
+SIMD_TARGET("avx2")
+static inline __m256i broadcast(std::uint32_t value) { return _mm256_set1_epi32((int)value); }
+
+SIMD_TARGET("avx2")
+static inline __m256i equal(__m256i a, __m256i b, std::uint8_t) { return _mm256_cmpeq_epi8(a, b); }
+SIMD_TARGET("avx2")
+static inline __m256i equal(__m256i a, __m256i b, std::uint16_t) { return _mm256_cmpeq_epi16(a, b); }
+SIMD_TARGET("avx2")
+static inline __m256i equal(__m256i a, __m256i b, std::uint32_t) { return _mm256_cmpeq_epi32(a, b); }
+
+//Returns a bit for every byte of the positions at data where the first and last element match,
+//so the sizeof(T) bits of a position are all set or all clear
+template <typename T>
+SIMD_TARGET("avx2")
+static inline std::uint32_t candidates(const T* data, size_t length, __m256i first, __m256i last)
+{
+	__m256i at_first = _mm256_loadu_si256((const __m256i*)data);
+	__m256i at_last = _mm256_loadu_si256((const __m256i*)(data + length - 1));
+	return (std::uint32_t)_mm256_movemask_epi8(_mm256_and_si256(equal(at_first, first, T()), equal(at_last, last, T())));
+}
+
+template <typename T>
+SIMD_TARGET("avx2")
+static size_t find_avx2(const T* data, size_t size, const T* pattern, size_t length, size_t from)
+{
+	const size_t lanes = 32 / sizeof(T);
+	const std::uint32_t position_bits = (1u << sizeof(T)) - 1;
+	const __m256i first = broadcast(pattern[0]);
+	const __m256i last = broadcast(pattern[length - 1]);
+
+	size_t i = from;
+	for (; i + length - 1 + lanes <= size; i += lanes)
+	{
+		std::uint32_t mask = candidates(data + i, length, first, last);
+		while (mask != 0)
+		{
+			int bit = __builtin_ctz(mask);
+			if (matches_inside(data, i + bit / sizeof(T), pattern, length))
+			{
+				return i + bit / sizeof(T);
+			}
+			mask &= ~(position_bits << bit);
+		}
+	}
+	return find_scalar(data, size, pattern, length, i);
+}
+
+template <typename T>
+SIMD_TARGET("avx2")
+static size_t rfind_avx2(const T* data, const T* pattern, size_t length, size_t end)
+{
+	const size_t lanes = 32 / sizeof(T);
+	const std::uint32_t position_bits = (1u << sizeof(T)) - 1;
+	const __m256i first = broadcast(pattern[0]);
+	const __m256i last = broadcast(pattern[length - 1]);
+
+	for (; end >= lanes; end -= lanes)
+	{
+		std::uint32_t mask = candidates(data + end - lanes, length, first, last);
+		while (mask != 0)
+		{
+			//The highest bit belongs to the last byte of the position
+			int bit = (31 - __builtin_clz(mask)) / sizeof(T) * sizeof(T);
+			if (matches_inside(data, end - lanes + bit / sizeof(T), pattern, length))
+			{
+				return end - lanes + bit / sizeof(T);
+			}
+			mask &= ~(position_bits << bit);
+		}
+	}
+	return rfind_scalar(data, pattern, length, end);
+}
+
+#endif
+
+template <typename T>
+static size_t find_elements(const T* data, size_t size, const T* pattern, size_t length, size_t from)
+{
+	if (length == 0)
+	{
+		return from <= size ? from : npos;
+	}
+	if (length > size || from > size - length)
+	{
+		return npos;
+	}
+#ifdef SIMD_X86
+	if (simd::has_avx2())
+	{
+		return find_avx2(data, size, pattern, length, from);
+	}
+#endif
+	return find_scalar(data, size, pattern, length, from);
+}
+
+template <typename T>
+static size_t rfind_elements(const T* data, size_t size, const T* pattern, size_t length, size_t before)
+{
+	if (length > size)
+	{
+		return npos;
+	}
+	//Positions the pattern starts at before end, up to the last one it fits at
+	size_t end = std::min(before, size - length + 1);
+	if (length == 0)
+	{
+		return before > 0 ? end - 1 : npos;
+	}
+#ifdef SIMD_X86
+	if (simd::has_avx2())
+	{
+		return rfind_avx2(data, pattern, length, end);
+	}
+#endif
+	return rfind_scalar(data, pattern, length, end);
+}
+
+//The pattern stored with every codepoint width, so texts of any width are searched
+//without converting it again
+class StoredPattern
+{
+	std::vector<std::uint8_t> latin1;
+	std::vector<std::uint16_t> ucs2;
+	std::vector<utf8::uint32_t> utf32;
+	//Texts of a width too narrow for the pattern cannot contain it
+	bool fits_latin1;
+	bool fits_ucs2;
+
+	template <typename T>
+	static bool store(const UnicodeString& pattern, std::vector<T>& elements)
+	{
+		for (size_t i = 0; i < pattern.size(); i++)
+		{
+			if (pattern[i] > std::numeric_limits<T>::max())
+			{
+				return false;
+			}
+			elements.push_back((T)pattern[i]);
+		}
+		return true;
+	}
+public:
+	explicit StoredPattern(const UnicodeString& pattern)
+		: fits_latin1(store(pattern, latin1)), fits_ucs2(store(pattern, ucs2))
+	{
+		store(pattern, utf32);
+	}
+
+	size_t size() const { return utf32.size(); }
+	//Returns the pattern stored with the width of the text, or nullptr if it doesn't fit it
+	const std::vector<std::uint8_t>* like(const std::uint8_t*) const { return fits_latin1 ? &latin1 : nullptr; }
+	const std::vector<std::uint16_t>* like(const std::uint16_t*) const { return fits_ucs2 ? &ucs2 : nullptr; }
+	const std::vector<utf8::uint32_t>* like(const utf8::uint32_t*) const { return &utf32; }
+};
+
+//Calls f(data, size, first, elements) in order for the runs of the raw storage of the text
+//around the gap an edited text has, where first is the position of data, with the pattern
+//stored with the same width. Doesn't call it if the pattern doesn't fit the width.
+//The text is read in place, so several threads can search it at once.
+template <typename function>
+static void with_runs(const UnicodeString& text, const StoredPattern& pattern, function&& f)
+{
+	text.visit_runs(0, text.size(), [&](auto begin, auto end, size_t first)
+	{
+		auto elements = pattern.like(begin);
+		if (elements)
+		{
+			f(begin, (size_t)(end - begin), first, *elements);
+		}
+	});
+}
+
+//Returns whether the pattern occurs at pos, for matches spanning the gap
+template <typename T>
+static bool matches_at(const UnicodeString& text, const std::vector<T>& elements, size_t pos)
+{
+	if (pos + elements.size() > text.size())
+	{
+		return false;
+	}
+	for (size_t i = 0; i < elements.size(); i++)
+	{
+		if (text[pos + i] != elements[i])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static size_t find_stored(const UnicodeString& text, const StoredPattern& pattern, size_t from)
+{
+	if (pattern.size() == 0)
+	{
+		return from <= text.size() ? from : npos;
+	}
+	size_t result = npos;
+	with_runs(text, pattern, [&](auto data, size_t size, size_t first, auto& elements)
+	{
+		if (result != npos)
+		{
+			return;
+		}
+		size_t found = find_elements(data, size, elements.data(), elements.size(), from > first ? from - first : 0);
+		if (found != npos)
+		{
+			result = first + found;
+			return;
+		}
+		//Matches starting in this run and ending in the next come after those inside it
+		size_t end = first + size;
+		for (size_t pos = std::max(std::max(from, first), end - std::min(size, elements.size() - 1)); pos < end; pos++)
+		{
+			if (matches_at(text, elements, pos))
+			{
+				result = pos;
+				return;
+			}
+		}
+	});
+	return result;
+}
+
+static size_t rfind_stored(const UnicodeString& text, const StoredPattern& pattern, size_t before)
+{
+	if (pattern.size() == 0)
+	{
+		return before > 0 ? std::min(before, text.size() + 1) - 1 : npos;
+	}
+	size_t result = npos;
+	with_runs(text, pattern, [&](auto data, size_t size, size_t first, auto& elements)
+	{
+		if (before <= first)
+		{
+			return;
+		}
+		size_t found = rfind_elements(data, size, elements.data(), elements.size(), before - first);
+		if (found != npos)
+		{
+			result = first + found;
+		}
+		//Matches spanning into the next run come after those inside this one
+		size_t end = first + size;
+		for (size_t pos = std::min(before, end); pos-- > std::max(first, end - std::min(size, elements.size() - 1));)
+		{
+			if (matches_at(text, elements, pos))
+			{
+				result = pos;
+				return;
+			}
+		}
+	});
+	return result;
+}
+
+namespace search
+{
+	size_t find(const char* data, size_t size, const std::string& pattern, size_t from)
+	{
+		return find_elements((const std::uint8_t*)data, size, (const std::uint8_t*)pattern.data(), pattern.size(), from);
+	}
+
+	size_t find(const UnicodeString& text, const UnicodeString& pattern, size_t from)
+	{
+		return find_stored(text, StoredPattern(pattern), from);
+	}
+
+	size_t rfind(const char* data, size_t size, const std::string& pattern, size_t before)
+	{
+		return rfind_elements((const std::uint8_t*)data, size, (const std::uint8_t*)pattern.data(), pattern.size(), before);
+	}
+
+	size_t rfind(const UnicodeString& text, const UnicodeString& pattern, size_t before)
+	{
+		return rfind_stored(text, StoredPattern(pattern), before);
+	}
+
+	//Contiguous run of the bytes of a buffer and the position of its first byte
+	struct ByteRun
+	{
+		const char* data;
+		size_t start;
+		size_t length;
+	};
+
+	static std::vector<ByteRun> byte_runs(const OctetBuffer& data)
+	{
+		std::vector<ByteRun> runs;
+		size_t start = 0;
+		data.visit(0, data.size(), [&](const char* first, const char* last) {
+			runs.push_back(ByteRun{ first, start, (size_t)(last - first) });
+			start += last - first;
+		});
+		return runs;
+	}
+
+	//Copies the bytes around the end of a run that a match spanning runs can start at,
+	//from seam_start on, and the bytes after them it can end in
+	static std::string read_seam(const OctetBuffer& data, size_t seam_start, size_t end, size_t length)
+	{
+		std::string seam;
+		data.visit(seam_start, std::min(data.size(), end + length - 1) - seam_start, [&](const char* first, const char* last) {
+			seam.append(first, last);
+		});
+		return seam;
+	}
+
+	size_t find(const OctetBuffer& data, const std::string& pattern, size_t from)
+	{
+		if (pattern.empty())
+		{
+			return find(NULL, data.size(), pattern, from);
+		}
+		for (const ByteRun& run : byte_runs(data))
+		{
+			size_t end = run.start + run.length;
+			if (end <= from)
+			{
+				continue;
+			}
+			size_t found = find(run.data, run.length, pattern, from > run.start ? from - run.start : 0);
+			if (found != npos)
+			{
+				return run.start + found;
+			}
+			if (end == data.size())
+			{
+				break;
+			}
+			//Matches starting in this run and ending in the next ones come after those inside it
+			size_t seam_start = std::max(std::max(from, run.start), end - std::min(end, pattern.size() - 1));
+			std::string seam = read_seam(data, seam_start, end, pattern.size());
+			found = find(seam.data(), seam.size(), pattern, 0);
+			if (found != npos && seam_start + found < end)
+			{
+				return seam_start + found;
+			}
+		}
+		return npos;
+	}
+
+	size_t rfind(const OctetBuffer& data, const std::string& pattern, size_t before)
+	{
+		if (pattern.empty())
+		{
+			return rfind(NULL, data.size(), pattern, before);
+		}
+		std::vector<ByteRun> runs = byte_runs(data);
+		for (auto run = runs.rbegin(); run != runs.rend(); ++run)
+		{
+			size_t end = run->start + run->length;
+			if (run->start >= before)
+			{
+				continue;
+			}
+			//Matches spanning into the next runs come after those inside this one
+			size_t seam_start = std::max(run->start, end - std::min(end, pattern.size() - 1));
+			if (end < data.size() && seam_start < before)
+			{
+				std::string seam = read_seam(data, seam_start, end, pattern.size());
+				size_t found = rfind(seam.data(), seam.size(), pattern, std::min(end, before) - seam_start);
+				if (found != npos)
+				{
+					return seam_start + found;
+				}
+			}
+			size_t found = rfind(run->data, run->length, pattern, before - run->start);
+			if (found != npos)
+			{
+				return run->start + found;
+			}
+		}
+		return npos;
+	}
+
+	static bool contains(const MultipartDocument& document, const MultipartEntry& part, const StoredPattern& text, const std::string& bytes, bool contents);
+
+	static bool contains(const Document& document, const StoredPattern& text, const std::string& bytes)
+	{
+		switch (document.get_type())
+		{
+		case OctetDocumentType:
+		{
+			return find(dynamic_cast<const OctetDocument&>(document).data, bytes, 0) != npos;
+		}
+		case UnicodeDocumentType:
+			return find_stored(dynamic_cast<const UnicodeDocument&>(document).data, text, 0) != npos;
+		case MultipartDocumentType:
+		{
+			const MultipartDocument& nested = dynamic_cast<const MultipartDocument&>(document);
+			return std::any_of(nested.data.begin(), nested.data.end(), [&](const MultipartEntry& part)
+			{
+				return contains(nested, part, text, bytes, true);
+			});
+		}
+		}
+		return false;
+	}
+
+	//Parts that weren't decoded yet are only read, a search doesn't decode the whole document
+	//and parts can be read on several threads
+	static bool contains(const MultipartDocument& document, const MultipartEntry& part, const StoredPattern& text, const std::string& bytes, bool contents)
+	{
+		UnicodeString read_key;
+		const UnicodeString& key = part.encoded_key ? (read_key = document.source->read_key(part)) : part.key;
+		if (find_stored(key, text, 0) != npos)
+		{
+			return true;
+		}
+		if (!contents || part.checked_out)
+		{
+			return false;
+		}
+		if (part.document)
+		{
+			return contains(*part.document, text, bytes);
+		}
+		return document.source && contains(*document.source->read_document(part), text, bytes);
+	}
+
+	size_t find_part(const MultipartDocument& document, const Pattern& pattern, size_t after, bool backward, bool contents)
+	{
+		//The parts are taken in search order, the nth one to search at a time, so every part
+		//before the first match is searched and none much after it
+		StoredPattern text(pattern.text);
+		size_t count = document.data.size();
+		std::atomic<size_t> next{ 0 };
+		std::atomic<size_t> first_match{ count };
+		auto search_parts = [&]()
+		{
+			for (size_t nth = next++; nth < first_match.load(); nth = next++)
+			{
+				size_t index = backward ? (after + count - 1 - nth) % count : (after + 1 + nth) % count;
+				if (contains(document, document.data[index], text, pattern.bytes, contents))
+				{
+					size_t current = first_match.load();
+					while (nth < current && !first_match.compare_exchange_weak(current, nth))
+					{
+					}
+				}
+			}
+		};
+		//Keys alone are searched on this thread
+		std::vector<std::future<void>> workers;
+		for (unsigned i = 1; contents && i < std::thread::hardware_concurrency(); i++)
+		{
+			workers.push_back(std::async(std::launch::async, search_parts));
+		}
+		search_parts();
+		for (auto&& worker : workers)
+		{
+			worker.get();
+		}
+
+		size_t nth = first_match.load();
+		if (nth == count)
+		{
+			return count;
+		}
+		return backward ? (after + count - 1 - nth) % count : (after + 1 + nth) % count;
+	}
+}
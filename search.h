@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+#include "document.h"
+
+namespace search
+{
+	//What to search for, as codepoints in unicode documents and keys
+	//and as bytes in octet documents
+	struct Pattern
+	{
+		UnicodeString text;
+		std::string bytes;
+	};
+
+	//Returns the position of the first occurrence of the pattern starting at or after from,
+	//or std::string::npos if there is none. Runs vectorized where the CPU supports it.
+	size_t find(const char* data, size_t size, const std::string& pattern, size_t from);
+	size_t find(const UnicodeString& text, const UnicodeString& pattern, size_t from);
+	//Returns the position of the last occurrence of the pattern starting before before,
+	//or std::string::npos if there is none
+	size_t rfind(const char* data, size_t size, const std::string& pattern, size_t before);
+	size_t rfind(const UnicodeString& text, const UnicodeString& pattern, size_t before);
+	//The same over a buffer whose bytes edits may have split into pieces, which are
+	//searched where they are, matches spanning pieces included
+	size_t find(const OctetBuffer& data, const std::string& pattern, size_t from);
+	size_t rfind(const OctetBuffer& data, const std::string& pattern, size_t before);
+
+	//Returns the position of the first part after the given one (or before it if backward,
+	//wrapping around) whose key contains the pattern, or data.size() if there is none.
+	//With contents set, the documents of the parts are searched as well, also those of
+	//nested multipart documents, on several threads at once. Parts that weren't decoded
+	//yet are read from the source without decoding them for good, and texts are read in
+	//place around the gap of edited ones, so the threads never modify what they share.
+	size_t find_part(const MultipartDocument& document, const Pattern& pattern, size_t after, bool backward, bool contents);
+}
@@ -0,0 +1,42 @@
+#include "simd.h"
+
+#include <cstdlib>
+
+namespace simd
+{
+	static bool disabled()
+	{
+		static const bool value = getenv("GENCODER_NO_SIMD") != NULL;
+		return value;
+	}
+
+	bool has_ssse3()
+	{
+#ifdef SIMD_X86
+		static const bool value = !disabled() && __builtin_cpu_supports("ssse3");
+		return value;
+#else
+		return false;
+#endif
+	}
+
+	bool has_sse41()
+	{
+#ifdef SIMD_X86
+		static const bool value = !disabled() && __builtin_cpu_supports("sse4.1");
+		return value;
+#else
+		return false;
+#endif
+	}
+
+	bool has_avx2()
+	{
+#ifdef SIMD_X86
+		static const bool value = !disabled() && __builtin_cpu_supports("avx2");
+		return value;
+#else
+		return false;
+#endif
+	}
+}
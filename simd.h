@@ -0,0 +1,18 @@
+#pragma once
+
+//Vectorized kernels are only built for x86 with a GCC compatible compiler, which lets
+//them be compiled for a specific instruction set per function and selected at runtime.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86 1
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#include <immintrin.h>
+#endif
+
+namespace simd
+{
+	//Runtime CPU feature detection (cpuid). All of them return false on other platforms
+	//or when the GENCODER_NO_SIMD environment variable is set.
+	bool has_ssse3();
+	bool has_sse41();
+	bool has_avx2();
+}
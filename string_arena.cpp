@@ -0,0 +1,48 @@
+#include "string_arena.h"
+
+#include <algorithm>
+
+//Codepoints per block, strings longer than a sixteenth of the largest block get no view
+static const size_t first_block_size = 256;
+static const size_t max_block_size = 64 * 1024;
+
+//Returns an empty string with room for size codepoints, stored with the width of the vector
+template <typename vector>
+static std::shared_ptr<UnicodeString> make_block(UnicodeString (*from)(vector&&), size_t size)
+{
+	vector storage;
+	storage.reserve(size);
+	return std::make_shared<UnicodeString>(from(std::move(storage)));
+}
+
+UnicodeString StringArena::store(UnicodeString&& str)
+{
+	if (str.empty() || str.size() > max_block_size / 16)
+	{
+		return std::move(str);
+	}
+	size_t index = str.width() == 1 ? 0 : (str.width() == 2 ? 1 : 2);
+	std::shared_ptr<UnicodeString>& block = blocks[index];
+	if (!block || block->size() + str.size() > block_sizes[index])
+	{
+		//Blocks get bigger as more strings are stored
+		block_sizes[index] = std::max(str.size(), block ? std::min(block_sizes[index] * 2, max_block_size) : first_block_size);
+		//Blocks never grow past their initial capacity, as views refer to them
+		switch (str.width())
+		{
+		case 1:
+			block = make_block(&UnicodeString::from_latin1, block_sizes[index]);
+			break;
+		case 2:
+			block = make_block(&UnicodeString::from_ucs2, block_sizes[index]);
+			break;
+		default:
+			block = make_block(&UnicodeString::from_utf32, block_sizes[index]);
+			break;
+		}
+		allocated_size += block_sizes[index] * str.width();
+	}
+	size_t offset = block->size();
+	block->append(str);
+	return UnicodeString::view(block, offset, str.size());
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <memory>
+#include <cstddef>
+
+#include "unicode_string.h"
+
+//Monotonic storage for many small strings that live as long as the document they
+//belong to. Strings are copied one after another into large shared blocks and
+//handed out as views, so they need no allocation of their own. A block is freed
+//at once together with the last view of it.
+class StringArena
+{
+	//Block being filled for each codepoint width
+	std::shared_ptr<UnicodeString> blocks[3];
+	size_t block_sizes[3] = {};
+	size_t allocated_size = 0;
+public:
+	//Returns a view of a copy of the string. Strings too big to share a block
+	//are returned as they are.
+	UnicodeString store(UnicodeString&& str);
+
+	//Returns the number of bytes of all blocks created so far
+	size_t memory_usage() const { return allocated_size; }
+};
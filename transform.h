@@ -5,6 +5,22 @@
 
 enum TransformType {EncodeTransformType, DecodeTransformType, NoneTransformType};
 
+//Incremental form of a transform. The input is pushed in chunks, which are
+//documents of a type the transform accepts, and every push returns the output
+//that can be produced so far. Incomplete sequences at the end of a chunk
+//(base64 quads, UTF-8 chars, form data pairs) are carried over to the next one.
+class TransformStream
+{
+public:
+	//Returns the output for the next chunk of input
+	virtual std::unique_ptr<Document> push(const Document& chunk) = 0;
+
+	//Returns the output for the state carried over at the end of input
+	virtual std::unique_ptr<Document> finish() = 0;
+
+	virtual ~TransformStream() = default;
+};
+
 class Transform
 {
 public:
@@ -21,8 +37,28 @@ public:
 	//Returns a document created by transformin the input
 	virtual std::unique_ptr<Document> transform(const Document& input) const = 0;
 
+	//Returns the transformation of a dirty input, given previous_output, the document the
+	//input was originally decoded from. Transforms able to do so only transform the
+	//dirty part of the input and splice it into previous_output, which is then returned
+	//marked dirty in turn. By default the whole input is transformed again.
+	virtual std::unique_ptr<Document> transform_incremental(const Document& input, std::unique_ptr<Document> previous_output) const
+	{
+		std::unique_ptr<Document> result = transform(input);
+		result->mark_dirty();
+		return result;
+	}
+
 	//Returns a description of this transformation
 	virtual const std::string get_description() const = 0;
+
+	//Returns a stream performing this transformation chunk by chunk,
+	//or nullptr if it can only transform whole documents
+	virtual std::unique_ptr<TransformStream> make_stream() const
+	{
+		return nullptr;
+	}
+
+	virtual ~Transform() = default;
 };
 
 class TransformError : public std::runtime_error {
@@ -1,8 +1,11 @@
 #include "b64.h"
 
 #include <array>
+#include <algorithm>
+#include "b64_simd.h"
 #include "../utf8.h"
 #include "../utf8_charclass.h"
+#include "../progress.h"
 
 //Based on https://stackoverflow.com/a/13935718/3864664
 
@@ -11,10 +14,6 @@ static const std::string base64_chars =
 "abcdefghijklmnopqrstuvwxyz"
 "0123456789+/";
 
-static inline bool is_base64(char c) {
-	return (isalnum(c) || (c == '+') || (c == '/'));
-}
-
 bool Base64Decode::accepts_type(DocType type) const
 {
 	return type == UnicodeDocumentType;
@@ -30,78 +29,194 @@ std::unique_ptr<Transform> Base64Decode::get_reverse_transform() const
 	return std::make_unique<Base64Encode>();
 }
 
-std::unique_ptr<Document> Base64Decode::transform(const Document& input) const
+//Values in decode_table that are not 6-bit values
+static const unsigned char b64_space = 0x40;
+static const unsigned char b64_padding = 0x41;
+static const unsigned char b64_invalid = 0xFF;
+
+static std::array<unsigned char, 256> make_decode_table()
 {
-	if (input.get_type() != UnicodeDocumentType)
+	std::array<unsigned char, 256> table;
+	table.fill(b64_invalid);
+	for (size_t i = 0; i < base64_chars.size(); i++)
 	{
-		throw TransformError("Base64 Decoder only accepts unicode documents");
+		table[(unsigned char)base64_chars[i]] = (unsigned char)i;
 	}
-	const UnicodeDocument& doc = dynamic_cast<const UnicodeDocument&>(input);
+	for (utf8::uint32_t c = 0; c < 256; c++)
+	{
+		if (utf8::is_space(c))
+		{
+			table[c] = b64_space;
+		}
+	}
+	table['='] = b64_padding;
+	return table;
+}
 
-	std::unique_ptr<OctetDocument> result = std::make_unique<OctetDocument>();
+//Maps Latin-1 codepoints to their 6-bit value, or one of the special values above
+static const std::array<unsigned char, 256> decode_table = make_decode_table();
 
+//Decoding state carried between input characters
+class Base64DecodeState
+{
+	std::array<unsigned char, 4> char_array;
 	int i = 0;
-	std::array<char, 4> char_array;
-	
 	int equals_count = 0;
+public:
+	//Whether the following characters can be decoded in whole quads
+	bool at_quad_start() const
+	{
+		return i == 0 && equals_count == 0;
+	}
 
-	for (auto&& a : doc.data)
+	//Returns false for chars that are not part of the base64 alphabet (whitespace and padding)
+	bool push(utf8::uint32_t a, char*& out)
 	{
-		if (utf8::is_space(a))
+		unsigned char value = a < 256 ? decode_table[a] : (utf8::is_space(a) ? b64_space : b64_invalid);
+		if (value == b64_space)
 		{
-			continue;
+			return false;
 		}
 		if (equals_count > 2)
 		{
 			throw TransformError("Invalid base64 input");
 		}
-		if (a == '=')
+		if (value == b64_padding)
 		{
 			equals_count++;
-			continue;
+			return false;
 		}
 		if (equals_count != 0)
 		{
 			throw TransformError("Invalid base64 input");
 		}
-
-		if (a >= 128 || !is_base64(a))
+		if (value == b64_invalid)
 		{
 			throw TransformError("Encountered a non-base64 char");
 		}
-		char_array[i++] = (char)a;
+		char_array[i++] = value;
 		if (i == 4)
 		{
-			for (i = 0; i < 4; i++)
-			{
-				char_array[i] = (char)base64_chars.find(char_array[i]);
-			}
-			result->data.push_back((char_array[0] << 2) + ((char_array[1] & 0x30) >> 4));
-			result->data.push_back(((char_array[1] & 0xf) << 4) + ((char_array[2] & 0x3c) >> 2));
-			result->data.push_back(((char_array[2] & 0x3) << 6) + char_array[3]);
+			*out++ = (char_array[0] << 2) + ((char_array[1] & 0x30) >> 4);
+			*out++ = ((char_array[1] & 0xf) << 4) + ((char_array[2] & 0x3c) >> 2);
+			*out++ = ((char_array[2] & 0x3) << 6) + char_array[3];
 			i = 0;
 		}
+		return true;
 	}
 
+	//Flushes an incomplete trailing quad
+	void finish(char*& out)
+	{
+		if (i) {
+			for (int j = i; j < 4; j++)
+				char_array[j] = 0;
 
-	if (i) {
-		for (int j = i; j <4; j++)
-			char_array[j] = 0;
-
-		for (int j = 0; j < i; j++)
-			char_array[j] = (char)base64_chars.find(char_array[j]);
+			*out++ = (char_array[0] << 2) + ((char_array[1] & 0x30) >> 4);
+			if (i > 2)
+			{
+				*out++ = ((char_array[1] & 0xf) << 4) + ((char_array[2] & 0x3c) >> 2);
+			}
+			i = 0;
+		}
+	}
+};
 
-		if (i > 0)
+template <typename char_type>
+static void decode_chars(const char_type* in, size_t len, Base64DecodeState& state, char*& out)
+{
+	size_t pos = 0;
+	if (sizeof(char_type) != 1)
+	{
+		//Wider chars mean the text is not pure base64, the kernels only handle Latin-1
+		for (; pos < len; pos++)
+		{
+			state.push(in[pos], out);
+		}
+		return;
+	}
+	while (pos < len)
+	{
+		if (state.at_quad_start())
 		{
-			result->data.push_back((char_array[0] << 2) + ((char_array[1] & 0x30) >> 4));
+			size_t done = b64simd::decode((const std::uint8_t*)in + pos, len - pos, out);
+			pos += done;
+			out += done / 4 * 3;
 		}
-		if (i > 2)
+		//Decode the block the kernel stopped at up to the first non-alphabet char
+		//and the end of its quad, after which the kernel can take over again
+		bool passed_special = false;
+		while (pos < len && !(passed_special && state.at_quad_start()))
 		{
-			result->data.push_back(((char_array[1] & 0xf) << 4) + ((char_array[2] & 0x3c) >> 2));
+			passed_special |= !state.push(in[pos++], out);
 		}
+	}
+}
+
+//Decodes base64 chunk by chunk, carrying the state of an incomplete quad
+class Base64DecodeStream : public TransformStream
+{
+	Base64DecodeState state;
+public:
+	std::unique_ptr<Document> push(const Document& chunk) final
+	{
+		if (chunk.get_type() != UnicodeDocumentType)
+		{
+			throw TransformError("Base64 Decoder only accepts unicode documents");
+		}
+		const UnicodeDocument& doc = dynamic_cast<const UnicodeDocument&>(chunk);
+
+		std::unique_ptr<OctetDocument> result = std::make_unique<OctetDocument>();
+		//Up to 3 carried chars can complete a quad with the chunk
+		result->data.resize((doc.data.size() + 3) / 4 * 3);
+		char* begin = result->data.mutable_data();
+		char* out = begin;
+		doc.data.visit([&](auto first, auto last) {
+			decode_chars(first, last - first, state, out);
+		});
+		result->data.resize(out - begin);
+		return move(result);
+	}
 
+	std::unique_ptr<Document> finish() final
+	{
+		std::unique_ptr<OctetDocument> result = std::make_unique<OctetDocument>();
+		char tail[2];
+		char* out = tail;
+		state.finish(out);
+		result->data.append(tail, out - tail);
+		return move(result);
+	}
+};
+
+std::unique_ptr<Document> Base64Decode::transform(const Document& input) const
+{
+	if (input.get_type() != UnicodeDocumentType)
+	{
+		throw TransformError("Base64 Decoder only accepts unicode documents");
 	}
-	
+	const UnicodeDocument& doc = dynamic_cast<const UnicodeDocument&>(input);
+
+	std::unique_ptr<OctetDocument> result = std::make_unique<OctetDocument>();
+
+	//Every char yields at most 3/4 of a byte, a trailing incomplete quad at most 2 bytes
+	result->data.resize(doc.data.size() / 4 * 3 + 2);
+	char* begin = result->data.mutable_data();
+	char* out = begin;
+
+	Base64DecodeState state;
+	doc.data.visit([&](auto first, auto last) {
+		//The state carries incomplete quads over, so the blocks can end anywhere
+		for (size_t pos = 0, len = last - first; pos < len; pos += progress_block)
+		{
+			size_t count = std::min(progress_block, len - pos);
+			decode_chars(first + pos, count, state, out);
+			report_progress(pos + count, len);
+		}
+	});
+	state.finish(out);
+
+	result->data.resize(out - begin);
 	return move(result);
 
 }
@@ -111,6 +226,11 @@ const std::string Base64Decode::get_description() const
 	return "Base64";
 }
 
+std::unique_ptr<TransformStream> Base64Decode::make_stream() const
+{
+	return std::make_unique<Base64DecodeStream>();
+}
+
 bool Base64Encode::accepts_type(DocType type) const
 {
 	return type == OctetDocumentType;
@@ -126,6 +246,103 @@ std::unique_ptr<Transform> Base64Encode::get_reverse_transform() const
 	return std::make_unique<Base64Decode>();
 }
 
+//Encodes all whole groups of 3 bytes, returns the number of bytes consumed
+static size_t encode_groups(const char* in, size_t len, std::uint8_t*& out)
+{
+	size_t pos = b64simd::encode(in, len, out);
+	out += pos / 3 * 4;
+
+	for (; pos + 3 <= len; pos += 3)
+	{
+		*out++ = base64_chars[(in[pos] & 0xfc) >> 2];
+		*out++ = base64_chars[((in[pos] & 0x03) << 4) + ((in[pos + 1] & 0xf0) >> 4)];
+		*out++ = base64_chars[((in[pos + 1] & 0x0f) << 2) + ((in[pos + 2] & 0xc0) >> 6)];
+		*out++ = base64_chars[in[pos + 2] & 0x3f];
+	}
+	return pos;
+}
+
+//Encodes the last 0 to 2 bytes with padding
+static void encode_tail(const char* in, size_t i, std::uint8_t*& out)
+{
+	if (i) {
+		std::array<char, 3> byte_array = { 0, 0, 0 };
+		for (size_t j = 0; j < i; j++)
+		{
+			byte_array[j] = in[j];
+		}
+
+		*out++ = base64_chars[(byte_array[0] & 0xfc) >> 2];
+		*out++ = base64_chars[((byte_array[0] & 0x03) << 4) + ((byte_array[1] & 0xf0) >> 4)];
+
+		if (i == 2)
+		{
+			*out++ = base64_chars[((byte_array[1] & 0x0f) << 2) + ((byte_array[2] & 0xc0) >> 6)];
+		}
+
+		for (size_t j = i; j < 3; j++)
+		{
+			*out++ = '=';
+		}
+	}
+}
+
+//Encodes bytes chunk by chunk, carrying the bytes of an incomplete group
+class Base64EncodeStream : public TransformStream
+{
+	std::array<char, 3> carried;
+	size_t carried_len = 0;
+public:
+	std::unique_ptr<Document> push(const Document& chunk) final
+	{
+		if (chunk.get_type() != OctetDocumentType)
+		{
+			throw TransformError("Base64 Encoder only accepts octet documents");
+		}
+		const OctetDocument& doc = dynamic_cast<const OctetDocument&>(chunk);
+		const char* in = doc.data.data();
+		size_t len = doc.data.size();
+
+		UnicodeString::latin1_vector encoded(4 * ((carried_len + len) / 3));
+		std::uint8_t* out = encoded.data();
+
+		if (carried_len)
+		{
+			size_t taken = std::min(3 - carried_len, len);
+			std::copy(in, in + taken, carried.begin() + carried_len);
+			carried_len += taken;
+			in += taken;
+			len -= taken;
+			if (carried_len < 3)
+			{
+				return std::make_unique<UnicodeDocument>();
+			}
+			encode_groups(carried.data(), 3, out);
+			carried_len = 0;
+		}
+
+		size_t pos = encode_groups(in, len, out);
+		carried_len = len - pos;
+		std::copy(in + pos, in + len, carried.begin());
+
+		std::unique_ptr<UnicodeDocument> result = std::make_unique<UnicodeDocument>();
+		result->data = UnicodeString::from_latin1(std::move(encoded));
+		return move(result);
+	}
+
+	std::unique_ptr<Document> finish() final
+	{
+		UnicodeString::latin1_vector encoded(carried_len ? 4 : 0);
+		std::uint8_t* out = encoded.data();
+		encode_tail(carried.data(), carried_len, out);
+		carried_len = 0;
+
+		std::unique_ptr<UnicodeDocument> result = std::make_unique<UnicodeDocument>();
+		result->data = UnicodeString::from_latin1(std::move(encoded));
+		return move(result);
+	}
+};
+
 std::unique_ptr<Document> Base64Encode::transform(const Document& input) const
 {
 	if (input.get_type() != OctetDocumentType)
@@ -134,49 +351,109 @@ std::unique_ptr<Document> Base64Encode::transform(const Document& input) const
 	}
 	const OctetDocument& doc = dynamic_cast<const OctetDocument&>(input);
 
-	std::unique_ptr<UnicodeDocument> result = std::make_unique<UnicodeDocument>();
+	const char* in = doc.data.data();
+	size_t len = doc.data.size();
 
-	size_t i = 0;
-	std::array<char, 3> byte_array;
+	//Every started group of 3 bytes is encoded (and padded) to 4 chars
+	UnicodeString::latin1_vector encoded(4 * ((len + 2) / 3));
+	std::uint8_t* out = encoded.data();
 
-	for (auto&& a : doc.data)
+	//Blocks of whole groups, reporting the progress after each
+	size_t pos = 0;
+	while (len - pos >= 3)
 	{
-		byte_array[i++] = a;
-		if (i == 3)
-		{
-			result->data.push_back(base64_chars[(byte_array[0] & 0xfc) >> 2]);
-			result->data.push_back(base64_chars[((byte_array[0] & 0x03) << 4) + ((byte_array[1] & 0xf0) >> 4)]);
-			result->data.push_back(base64_chars[((byte_array[1] & 0x0f) << 2) + ((byte_array[2] & 0xc0) >> 6)]);
-			result->data.push_back(base64_chars[byte_array[2] & 0x3f]);
-			i = 0;
-		}
+		pos += encode_groups(in + pos, std::min(len - pos, progress_block / 3 * 3), out);
+		report_progress(pos, len);
 	}
+	encode_tail(in + pos, len - pos, out);
 
+	std::unique_ptr<UnicodeDocument> result = std::make_unique<UnicodeDocument>();
+	result->data = UnicodeString::from_latin1(std::move(encoded));
+	return move(result);
+}
 
-	if (i) {
-		for (int j = i; j < 3; j++)
+//Returns the number of bytes the text decodes to if it is exactly what
+//Base64Encode produces for them, or std::string::npos otherwise
+static size_t canonical_decoded_size(const UnicodeString& text)
+{
+	size_t size = text.size();
+	if (text.width() != 1 || size % 4 != 0)
+	{
+		return std::string::npos;
+	}
+	size_t padding = 0;
+	while (padding < 2 && padding < size && text[size - padding - 1] == '=')
+	{
+		padding++;
+	}
+	bool canonical = true;
+	text.visit([&](auto first, auto last) {
+		for (auto it = first; it != last - padding; ++it)
 		{
-			byte_array[j] = 0;
+			if (*it >= 256 || decode_table[*it] >= 64)
+			{
+				canonical = false;
+				return;
+			}
 		}
-
-		result->data.push_back(base64_chars[(byte_array[0] & 0xfc) >> 2]);
-		result->data.push_back(base64_chars[((byte_array[0] & 0x03) << 4) + ((byte_array[1] & 0xf0) >> 4)]);
-		
-		if (i == 2)
+		//The bits of the last char not covered by the bytes have to be zero
+		if (padding)
 		{
-			result->data.push_back(base64_chars[((byte_array[1] & 0x0f) << 2) + ((byte_array[2] & 0xc0) >> 6)]);
+			unsigned char bits = decode_table[*(last - padding - 1)];
+			canonical = (bits & (padding == 1 ? 0x03 : 0x0F)) == 0;
 		}
+	});
+	return canonical ? size / 4 * 3 - padding : std::string::npos;
+}
 
-		for(int j = i;j<3;j++)
-		{
-			result->data.push_back('=');	
-		}
+std::unique_ptr<Document> Base64Encode::transform_incremental(const Document& input, std::unique_ptr<Document> previous_output) const
+{
+	if (!input.is_dirty() || input.get_type() != OctetDocumentType || previous_output->get_type() != UnicodeDocumentType)
+	{
+		return Transform::transform_incremental(input, std::move(previous_output));
 	}
+	const OctetBuffer& data = dynamic_cast<const OctetDocument&>(input).data;
+	UnicodeString& text = dynamic_cast<UnicodeDocument&>(*previous_output).data;
 
-	return move(result);
+	//Text with whitespace or unusual padding decodes to the same bytes, but its
+	//chars don't line up with the groups of bytes
+	size_t old_size = canonical_decoded_size(text);
+	if (old_size == std::string::npos)
+	{
+		return Transform::transform_incremental(input, std::move(previous_output));
+	}
+
+	//Whole groups of 3 bytes inside the clean prefix keep their chars. So do the
+	//groups inside the clean suffix, if the size changed by whole groups.
+	size_t size = data.size();
+	size_t groups = (size + 2) / 3;
+	size_t old_groups = (old_size + 2) / 3;
+	size_t groups_before = input.get_clean_prefix() / 3;
+	size_t groups_after = 0;
+	if (size % 3 == old_size % 3)
+	{
+		groups_after = groups - (size - input.get_clean_suffix() + 2) / 3;
+	}
+
+	const char* middle = data.data() + 3 * groups_before;
+	size_t middle_size = std::min(size, 3 * (groups - groups_after)) - 3 * groups_before;
+	UnicodeString::latin1_vector encoded(4 * ((middle_size + 2) / 3));
+	std::uint8_t* out = encoded.data();
+	size_t pos = encode_groups(middle, middle_size, out);
+	encode_tail(middle + pos, middle_size - pos, out);
+
+	text.replace(4 * groups_before, 4 * (old_groups - groups_after - groups_before), UnicodeString::from_latin1(std::move(encoded)));
+	text.close_gap();
+	previous_output->mark_dirty(4 * groups_before, 4 * groups_after);
+	return previous_output;
 }
 
 const std::string Base64Encode::get_description() const
 {
 	return "Base64";
 }
+
+std::unique_ptr<TransformStream> Base64Encode::make_stream() const
+{
+	return std::make_unique<Base64EncodeStream>();
+}
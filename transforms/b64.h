@@ -14,6 +14,7 @@ public:
 	std::unique_ptr<Transform> get_reverse_transform() const final;
 	std::unique_ptr<Document> transform(const Document& input) const final;
 	const std::string get_description() const final;
+	std::unique_ptr<TransformStream> make_stream() const final;
 };
 
 //This class implements encoding to Base64
@@ -26,5 +27,7 @@ public:
 	bool reverse_transform() const final;
 	std::unique_ptr<Transform> get_reverse_transform() const final;
 	std::unique_ptr<Document> transform(const Document& input) const final;
+	std::unique_ptr<Document> transform_incremental(const Document& input, std::unique_ptr<Document> previous_output) const final;
 	const std::string get_description() const final;
+	std::unique_ptr<TransformStream> make_stream() const final;
 };
\ No newline at end of file
@@ -0,0 +1,194 @@
+#include "b64_simd.h"
+
+#include <cstring>
+#include "../simd.h"
+
+//The kernels are based on the lookup/pshufb approach from
+//Wojciech Muła and Daniel Lemire: Faster Base64 Encoding and Decoding
+//Using AVX2 Instructions (https://arxiv.org/abs/1704.00605)
+
+#ifdef SIMD_X86
+
+SIMD_TARGET("sse4.1")
+static size_t decode_sse41(const std::uint8_t* in, size_t len, char* out)
+{
+	//Every valid char has a bit set in exactly one of the tables for its low and high nibble
+	const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	//Offsets from the ASCII value to the 6-bit value, indexed by the high nibble
+	const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i nibble_mask = _mm_set1_epi8(0x0f);
+	const __m128i slash = _mm_set1_epi8(0x2f);
+	const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+	size_t pos = 0;
+	for (; pos + 16 <= len; pos += 16)
+	{
+		__m128i str = _mm_loadu_si128((const __m128i*)(in + pos));
+		__m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), nibble_mask);
+		__m128i lo_nibbles = _mm_and_si128(str, nibble_mask);
+		__m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+		__m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+		if (!_mm_testz_si128(lo, hi))
+		{
+			break;
+		}
+		__m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(str, slash), hi_nibbles));
+		str = _mm_add_epi8(str, roll);
+
+		//Pack four 6-bit values into three bytes
+		__m128i merged = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+		merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+		merged = _mm_shuffle_epi8(merged, pack);
+
+		std::uint8_t tmp[16];
+		_mm_storeu_si128((__m128i*)tmp, merged);
+		memcpy(out, tmp, 12);
+		out += 12;
+	}
+	return pos;
+}
+
+SIMD_TARGET("avx2")
+static size_t decode_avx2(const std::uint8_t* in, size_t len, char* out)
+{
+	const __m256i lut_lo = _mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lut_hi = _mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i nibble_mask = _mm256_set1_epi8(0x0f);
+	const __m256i slash = _mm256_set1_epi8(0x2f);
+	const __m256i pack = _mm256_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+	size_t pos = 0;
+	for (; pos + 32 <= len; pos += 32)
+	{
+		__m256i str = _mm256_loadu_si256((const __m256i*)(in + pos));
+		__m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), nibble_mask);
+		__m256i lo_nibbles = _mm256_and_si256(str, nibble_mask);
+		__m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		__m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		if (!_mm256_testz_si256(lo, hi))
+		{
+			break;
+		}
+		__m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(str, slash), hi_nibbles));
+		str = _mm256_add_epi8(str, roll);
+
+		__m256i merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+		merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+		merged = _mm256_shuffle_epi8(merged, pack);
+		merged = _mm256_permutevar8x32_epi32(merged, lanes);
+
+		std::uint8_t tmp[32];
+		_mm256_storeu_si256((__m256i*)tmp, merged);
+		memcpy(out, tmp, 24);
+		out += 24;
+	}
+	//A block that failed here may still have a clean first half
+	return pos + decode_sse41(in + pos, len - pos, out);
+}
+
+SIMD_TARGET("ssse3")
+static inline __m128i encode_lane_ssse3(__m128i in)
+{
+	//Spread every 3 bytes to 4 bytes and extract the 6-bit values
+	in = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+	__m128i hi = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+	__m128i lo = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+	__m128i indices = _mm_or_si128(hi, lo);
+
+	//Map the values to ASCII by adding an offset selected by the value range
+	__m128i offsets = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	offsets = _mm_or_si128(offsets, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+	const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	return _mm_add_epi8(indices, _mm_shuffle_epi8(shift_lut, offsets));
+}
+
+SIMD_TARGET("ssse3")
+static size_t encode_ssse3(const char* in, size_t len, std::uint8_t* out)
+{
+	size_t pos = 0;
+	//Every step reads 16 bytes but only consumes 12
+	for (; pos + 16 <= len; pos += 12)
+	{
+		__m128i chars = encode_lane_ssse3(_mm_loadu_si128((const __m128i*)(in + pos)));
+		_mm_storeu_si128((__m128i*)out, chars);
+		out += 16;
+	}
+	return pos;
+}
+
+SIMD_TARGET("avx2")
+static size_t encode_avx2(const char* in, size_t len, std::uint8_t* out)
+{
+	const __m256i spread = _mm256_setr_epi8(
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	const __m256i shift_lut = _mm256_setr_epi8(
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+	size_t pos = 0;
+	//Every step reads 28 bytes but only consumes 24, 12 per lane
+	for (; pos + 28 <= len; pos += 24)
+	{
+		__m256i str = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(in + pos))),
+			_mm_loadu_si128((const __m128i*)(in + pos + 12)), 1);
+		str = _mm256_shuffle_epi8(str, spread);
+		__m256i hi = _mm256_mulhi_epu16(_mm256_and_si256(str, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+		__m256i lo = _mm256_mullo_epi16(_mm256_and_si256(str, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+		__m256i indices = _mm256_or_si256(hi, lo);
+
+		__m256i offsets = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		offsets = _mm256_or_si256(offsets, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices), _mm256_set1_epi8(13)));
+		__m256i chars = _mm256_add_epi8(indices, _mm256_shuffle_epi8(shift_lut, offsets));
+
+		_mm256_storeu_si256((__m256i*)out, chars);
+		out += 32;
+	}
+	return pos + encode_ssse3(in + pos, len - pos, out);
+}
+
+#endif
+
+namespace b64simd
+{
+	size_t decode(const std::uint8_t* in, size_t len, char* out)
+	{
+#ifdef SIMD_X86
+		if (simd::has_avx2())
+		{
+			return decode_avx2(in, len, out);
+		}
+		if (simd::has_sse41())
+		{
+			return decode_sse41(in, len, out);
+		}
+#endif
+		return 0;
+	}
+
+	size_t encode(const char* in, size_t len, std::uint8_t* out)
+	{
+#ifdef SIMD_X86
+		if (simd::has_avx2())
+		{
+			return encode_avx2(in, len, out);
+		}
+		if (simd::has_ssse3())
+		{
+			return encode_ssse3(in, len, out);
+		}
+#endif
+		return 0;
+	}
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+//Vectorized Base64 kernels, selected at runtime based on the CPU.
+//They only handle the plain alphabet; whitespace, padding and errors
+//are left to the scalar code in b64.cpp.
+namespace b64simd
+{
+	//Decodes leading blocks of base64 chars until a block containing anything
+	//else than the base64 alphabet is found.
+	//Returns the number of chars consumed (a multiple of 16). Three bytes per
+	//four consumed chars are written to out.
+	size_t decode(const std::uint8_t* in, size_t len, char* out);
+
+	//Encodes leading groups of bytes as base64 chars.
+	//Returns the number of bytes consumed (a multiple of 12) and writes
+	//four chars per three consumed bytes to out.
+	size_t encode(const char* in, size_t len, std::uint8_t* out);
+}
@@ -1,11 +1,305 @@
 #include "url.h"
 
+#include <algorithm>
+#include "../string_arena.h"
+#include "../progress.h"
+
 //Local function definitions
-std::vector<utf8::uint32_t> urldecode(const std::vector<utf8::uint32_t>& enc, bool plus_is_space);
-std::vector<utf8::uint32_t> urlencode(const std::vector<utf8::uint32_t>& dat, bool plus_is_space);
+UnicodeString urldecode(const UnicodeString& enc, bool plus_is_space);
+UnicodeString urlencode(const UnicodeString& dat, bool plus_is_space);
 char get_hex(char i);
 bool should_escape(utf8::uint32_t codepoint);
 
+//Decodes the parts of form data from their position in the text. Keys and
+//values without anything to unescape are views of the text, the others are
+//kept in an arena shared by all parts.
+class FormDataSource : public MultipartSource
+{
+	mutable StringArena arena;
+	//Chars of the field being unescaped, kept to reuse the memory
+	mutable UnicodeString field;
+
+	//Returns the decoded chars, any '=' in them is dropped. Unescaped chars are
+	//kept in the arena if keep is set.
+	UnicodeString decode_field(size_t pos, size_t count, bool keep) const
+	{
+		bool plain = true;
+		text->visit([&](auto begin, auto end) {
+			plain = std::none_of(begin + pos, begin + pos + count, [](utf8::uint32_t c) {
+				return c == '%' || c == '+' || c == '=';
+			});
+		});
+		if (plain)
+		{
+			return UnicodeString::view(text, pos, count);
+		}
+		//Only decoding for good may reuse the memory of the field
+		UnicodeString local;
+		UnicodeString& chars = keep ? field : local;
+		chars.clear();
+		for (size_t i = pos; i < pos + count; i++)
+		{
+			utf8::uint32_t c = (*text)[i];
+			if (c != '=')
+			{
+				chars.push_back(c);
+			}
+		}
+		return keep ? arena.store(urldecode(chars, true)) : urldecode(chars, true);
+	}
+
+	std::unique_ptr<Document> decode_value(const MultipartEntry& part, bool keep) const
+	{
+		std::unique_ptr<UnicodeDocument> document = std::make_unique<UnicodeDocument>();
+		if (part.source_key_length < part.source_length)
+		{
+			document->data = decode_field(part.source_offset + part.source_key_length + 1, part.source_length - part.source_key_length - 1, keep);
+		}
+		return std::move(document);
+	}
+public:
+	UnicodeString decode_key(const MultipartEntry& part) const final
+	{
+		return decode_field(part.source_offset, part.source_key_length, true);
+	}
+
+	std::unique_ptr<Document> decode_document(const MultipartEntry& part) const final
+	{
+		return decode_value(part, true);
+	}
+
+	UnicodeString read_key(const MultipartEntry& part) const final
+	{
+		return decode_field(part.source_offset, part.source_key_length, false);
+	}
+
+	std::unique_ptr<Document> read_document(const MultipartEntry& part) const final
+	{
+		return decode_value(part, false);
+	}
+
+	size_t memory_usage() const final
+	{
+		return text->memory_usage() + arena.memory_usage();
+	}
+};
+
+//Checks escape sequences the same way urldecode reads them, so that decoding
+//a part later can't fail
+class EscapeChecker
+{
+	char in_escaped = 0;
+	char buffer = 0;
+	std::string sequence;
+	//Errors are only reported for pairs that are kept
+	const char* error = nullptr;
+
+	void check_sequence()
+	{
+		if (utf8::find_invalid(sequence.begin(), sequence.end()) != sequence.end() && !error)
+		{
+			error = "Escape sequences don't form valid UTF-8";
+		}
+		sequence.clear();
+	}
+public:
+	void push(utf8::uint32_t a)
+	{
+		if (in_escaped)
+		{
+			char val = 0;
+			if (a >= '0' && a <= '9')
+			{
+				val = a - '0';
+			}
+			else if (a >= 'A' && a <= 'F')
+			{
+				val = a - 'A' + 10;
+			}
+			else if (a >= 'a' && a <= 'f')
+			{
+				val = a - 'a' + 10;
+			}
+			else if (!error) {
+				error = "Non-hexadecimal character in escape sequence";
+			}
+			in_escaped--;
+			buffer |= val << (4 * in_escaped);
+			if (!in_escaped)
+			{
+				sequence.push_back(buffer);
+				buffer = 0;
+			}
+		}
+		else if (a == '%')
+		{
+			in_escaped = 2;
+		}
+		else if (!sequence.empty())
+		{
+			check_sequence();
+		}
+	}
+
+	//Called at the end of every key and value
+	void end_field()
+	{
+		check_sequence();
+		in_escaped = 0;
+		buffer = 0;
+	}
+
+	//Called at the end of every pair that is kept
+	void end_pair()
+	{
+		end_field();
+		if (error)
+		{
+			throw TransformError(error);
+		}
+	}
+
+	//Called at the end of a pair that is left out
+	void drop_pair()
+	{
+		*this = EscapeChecker();
+	}
+};
+
+//Splits form data into key/value parts, which are only decoded once used.
+//An incomplete pair is carried between calls.
+class FormDataParser
+{
+	//Chars of the incomplete pair
+	UnicodeString pending;
+	//Position of the '=' in the incomplete pair, npos if there is none yet
+	size_t key_length = std::string::npos;
+	EscapeChecker escapes;
+
+	//Scans the chars following pending. Returns the number of them belonging
+	//to complete pairs, which are added to the result.
+	template <typename T>
+	size_t scan(const T* begin, const T* end, MultipartDocument& result)
+	{
+		size_t pair_start = 0;
+		size_t complete = 0;
+		result.data.reserve(result.data.size() + std::count(begin, end, '&') + 1);
+		//Scanned in blocks, reporting the progress after each
+		for (const T* block = begin; block != end;)
+		{
+			const T* block_end = (size_t)(end - block) > progress_block ? block + progress_block : end;
+			for (const T* it = block; it != block_end; ++it)
+			{
+				//Position relative to the start of pending
+				size_t position = pending.size() + (it - begin);
+				if (*it == '&')
+				{
+					escapes.end_pair();
+					result.data.emplace_back();
+					MultipartEntry& entry = result.data.back();
+					entry.source_offset = pair_start;
+					entry.source_length = position - pair_start;
+					entry.source_key_length = key_length == std::string::npos ? entry.source_length : key_length;
+					entry.encoded_key = true;
+					pair_start = position + 1;
+					key_length = std::string::npos;
+					complete = it - begin + 1;
+				}
+				else if (*it == '=')
+				{
+					if (key_length == std::string::npos)
+					{
+						escapes.end_field();
+						key_length = position - pair_start;
+					}
+				}
+				else {
+					escapes.push(*it);
+				}
+			}
+			block = block_end;
+			report_progress(block - begin, end - begin);
+		}
+		return complete;
+	}
+public:
+	void push(const UnicodeString& data, MultipartDocument& result)
+	{
+		size_t complete = 0;
+		data.visit([&](auto begin, auto end) {
+			complete = scan(begin, end, result);
+		});
+		if (complete == 0)
+		{
+			pending.append(data);
+			return;
+		}
+		//The text keeps the incomplete pair too, in case finish() is called with the same result
+		result.source = std::make_unique<FormDataSource>();
+		UnicodeString& text = *result.source->text;
+		if (pending.empty())
+		{
+			//Decoded text and parts are views, which share the text of the parent instead of
+			//copying it. Only text with storage of its own, like a chunk, is copied.
+			text = data;
+		}
+		else {
+			text = std::move(pending);
+			text.append(data);
+		}
+		pending = data.substr(complete, data.size() - complete);
+	}
+
+	void finish(MultipartDocument& result)
+	{
+		//A last pair without a key is left out
+		if (key_length == std::string::npos ? pending.empty() : key_length == 0)
+		{
+			escapes.drop_pair();
+			return;
+		}
+		escapes.end_pair();
+		MultipartEntry entry;
+		if (result.source)
+		{
+			entry.source_offset = result.source->text->size() - pending.size();
+		}
+		else {
+			result.source = std::make_unique<FormDataSource>();
+			*result.source->text = pending;
+		}
+		entry.source_length = pending.size();
+		entry.source_key_length = key_length == std::string::npos ? entry.source_length : key_length;
+		entry.encoded_key = true;
+		result.data.push_back(std::move(entry));
+		pending.clear();
+	}
+};
+
+//Decodes form data chunk by chunk, every output chunk holds the pairs completed so far
+class xwwwformurlencodedDecodeStream : public TransformStream
+{
+	FormDataParser parser;
+public:
+	std::unique_ptr<Document> push(const Document& chunk) final
+	{
+		if (chunk.get_type() != UnicodeDocumentType)
+		{
+			throw TransformError("x-www-form-urlencoded Decoder only accepts unicode documents");
+		}
+		std::unique_ptr<MultipartDocument> result = std::make_unique<MultipartDocument>();
+		parser.push(dynamic_cast<const UnicodeDocument&>(chunk).data, *result);
+		return result;
+	}
+
+	std::unique_ptr<Document> finish() final
+	{
+		std::unique_ptr<MultipartDocument> result = std::make_unique<MultipartDocument>();
+		parser.finish(*result);
+		return result;
+	}
+};
+
 bool xwwwformurlencodedDecode::accepts_type(DocType type) const
 {
 	return type == UnicodeDocumentType;
@@ -31,54 +325,84 @@ std::unique_ptr<Document> xwwwformurlencodedDecode::transform(const Document & i
 
 	const UnicodeDocument& doc = dynamic_cast<const UnicodeDocument&>(input);
 
+	FormDataParser parser;
+	parser.push(doc.data, *result);
+	parser.finish(*result);
+	result->source_generation = doc.get_generation();
+
+	return result;
+}
+
+const std::string xwwwformurlencodedDecode::get_description() const
+{
+	return "x-www-form-urlencoded";
+}
 
-	bool in_value = false;
-	std::vector<utf8::uint32_t> keybuff;
-	std::vector<utf8::uint32_t> valbuff;
+std::unique_ptr<TransformStream> xwwwformurlencodedDecode::make_stream() const
+{
+	return std::make_unique<xwwwformurlencodedDecodeStream>();
+}
 
+//Parts that weren't decoded yet are text anyway
+static void check_parts(const MultipartDocument& doc)
+{
 	for (auto&& a : doc.data)
 	{
-		if (a == '=')
+		if (a.document && a.document->get_type() != UnicodeDocumentType)
 		{
-			in_value = true;
+			throw TransformError("x-www-form-urlencoded encoder only accepts unicode documents inside the multipart");
 		}
-		else if (a == '&')
+	}
+}
+
+static UnicodeString encode_part(const MultipartEntry& part)
+{
+	UnicodeString result = urlencode(part.key, true);
+	result.push_back('=');
+	result.append(urlencode(dynamic_cast<const UnicodeDocument*>(part.document.get())->data, true));
+	return result;
+}
+
+//Serializes the parts, first tells whether no part was written before them
+static void encode_parts(const MultipartDocument& doc, bool& first, UnicodeString& result)
+{
+	check_parts(doc);
+
+	for (size_t i = 0; i < doc.data.size(); i++)
+	{
+		if (first)
 		{
-			std::unique_ptr<UnicodeDocument> part = std::make_unique<UnicodeDocument>();
-			part->data = std::move(urldecode(valbuff, true));
-			result->data.push_back(std::make_pair(std::move(urldecode(keybuff, true)), std::move(part)));
-			valbuff.clear();
-			keybuff.clear();
-			in_value = false;
+			first = false;
 		}
 		else {
-			if (in_value)
-			{
-				valbuff.push_back(a);
-			}
-			else {
-				keybuff.push_back(a);
-			}
+			result.push_back('&');
 		}
+		result.append(encode_part(doc.get_part(i)));
+		report_progress(i + 1, doc.data.size());
 	}
+}
 
-	if (!keybuff.empty())
+//Encodes form data chunk by chunk, each input chunk holding some of the parts
+class xwwwformurlencodedEncodeStream : public TransformStream
+{
+	bool first = true;
+public:
+	std::unique_ptr<Document> push(const Document& chunk) final
 	{
-		std::unique_ptr<UnicodeDocument> part = std::make_unique<UnicodeDocument>();
-		part->data = std::move(urldecode(valbuff, true));
-		result->data.push_back(std::make_pair(std::move(urldecode(keybuff, true)), std::move(part)));
-		valbuff.clear();
-		keybuff.clear();
-		in_value = false;
+		if (chunk.get_type() != MultipartDocumentType)
+		{
+			throw TransformError("x-www-form-urlencoded encoder only accepts multipart documents");
+		}
+		std::unique_ptr<UnicodeDocument> result = std::make_unique<UnicodeDocument>();
+		encode_parts(dynamic_cast<const MultipartDocument&>(chunk), first, result->data);
+		return result;
 	}
 
-	return result;
-}
-
-const std::string xwwwformurlencodedDecode::get_description() const
-{
-	return "x-www-form-urlencoded";
-}
+	std::unique_ptr<Document> finish() final
+	{
+		return std::make_unique<UnicodeDocument>();
+	}
+};
 
 bool xwwwformurlencodedEncode::accepts_type(DocType type) const
 {
@@ -104,35 +428,48 @@ std::unique_ptr<Document> xwwwformurlencodedEncode::transform(const Document & i
 	}
 	std::unique_ptr<UnicodeDocument> result = std::make_unique<UnicodeDocument>();
 
-	const MultipartDocument& doc = dynamic_cast<const MultipartDocument&>(input);
+	bool first = true;
+	encode_parts(dynamic_cast<const MultipartDocument&>(input), first, result->data);
 
-	for (auto&& a : doc.data)
+	return result;
+}
+
+std::unique_ptr<Document> xwwwformurlencodedEncode::transform_incremental(const Document& input, std::unique_ptr<Document> previous_output) const
+{
+	if (input.get_type() != MultipartDocumentType || previous_output->get_type() != UnicodeDocumentType
+		|| dynamic_cast<const MultipartDocument&>(input).source_generation != previous_output->get_generation())
 	{
-		if (a.second->get_type() != UnicodeDocumentType)
-		{
-			throw TransformError("x-www-form-urlencoded encoder only accepts unicode documents inside the multipart");
-		}
+		return Transform::transform_incremental(input, std::move(previous_output));
 	}
+	const MultipartDocument& doc = dynamic_cast<const MultipartDocument&>(input);
+	UnicodeString& text = dynamic_cast<UnicodeDocument&>(*previous_output).data;
+	check_parts(doc);
 
-	bool first = true;
-
-	for (auto&& a : doc.data)
+	//Splice the modified parts into the text they were decoded from, starting
+	//from the end so the positions of the remaining parts stay valid
+	size_t old_size = text.size();
+	size_t clean_prefix = old_size;
+	size_t clean_suffix = old_size;
+	for (auto it = doc.data.rbegin(); it != doc.data.rend(); ++it)
 	{
-		if (first)
+		if (!it->dirty)
 		{
-			first = false;
+			continue;
 		}
-		else {
-			result->data.push_back('&');
+		if (clean_suffix == old_size)
+		{
+			clean_suffix = old_size - it->source_offset - it->source_length;
 		}
-		std::vector<utf8::uint32_t> buff = std::move(urlencode(a.first, true));
-		result->data.insert(result->data.end(), buff.begin(), buff.end());
-		result->data.push_back('=');
-		buff = std::move(urlencode(dynamic_cast<const UnicodeDocument*>(a.second.get())->data, true));
-		result->data.insert(result->data.end(), buff.begin(), buff.end());
+		clean_prefix = it->source_offset;
+		text.replace(it->source_offset, it->source_length, encode_part(*it));
 	}
-
-	return result;
+	//Going through the parts backwards only moved the gap back over the clean ones
+	text.close_gap();
+	if (clean_prefix != old_size)
+	{
+		previous_output->mark_dirty(clean_prefix, clean_suffix);
+	}
+	return previous_output;
 }
 
 const std::string xwwwformurlencodedEncode::get_description() const
@@ -140,12 +477,19 @@ const std::string xwwwformurlencodedEncode::get_description() const
 	return "x-www-form-urlencoded";
 }
 
-std::vector<utf8::uint32_t> urldecode(const std::vector<utf8::uint32_t>& enc, bool plus_is_space)
+std::unique_ptr<TransformStream> xwwwformurlencodedEncode::make_stream() const
+{
+	return std::make_unique<xwwwformurlencodedEncodeStream>();
+}
+
+UnicodeString urldecode(const UnicodeString& enc, bool plus_is_space)
 {
 	char in_escaped = 0;
 	char buffer = 0;
-	std::vector<char> sequence;
-	std::vector<utf8::uint32_t> result;
+	//Escape sequences of a single codepoint fit without allocating
+	std::string sequence;
+	UnicodeString result;
+	result.reserve(enc.size());
 
 	for (auto&& a : enc)
 	{
@@ -209,9 +553,10 @@ std::vector<utf8::uint32_t> urldecode(const std::vector<utf8::uint32_t>& enc, bo
 	return result;
 }
 
-std::vector<utf8::uint32_t> urlencode(const std::vector<utf8::uint32_t>& dat, bool plus_is_space)
+UnicodeString urlencode(const UnicodeString& dat, bool plus_is_space)
 {
-	std::vector<utf8::uint32_t> result;
+	UnicodeString result;
+	result.reserve(dat.size());
 
 	for (auto&& a : dat)
 	{
@@ -222,13 +567,13 @@ std::vector<utf8::uint32_t> urlencode(const std::vector<utf8::uint32_t>& dat, bo
 		}
 		if (should_escape(a))
 		{
-			std::vector<char> utf8enc;
-			utf8::append(a, std::back_inserter(utf8enc));
-			for (auto&& c : utf8enc)
+			char utf8enc[4];
+			char* end = utf8::append(a, utf8enc);
+			for (char* c = utf8enc; c != end; c++)
 			{
 				result.push_back('%');
-				result.push_back(get_hex((c >> 4) & 0xF));
-				result.push_back(get_hex(c & 0xF));
+				result.push_back(get_hex((*c >> 4) & 0xF));
+				result.push_back(get_hex(*c & 0xF));
 			}
 		}
 		else
@@ -11,6 +11,7 @@ public:
 	std::unique_ptr<Transform> get_reverse_transform() const final;
 	std::unique_ptr<Document> transform(const Document& input) const final;
 	const std::string get_description() const final;
+	std::unique_ptr<TransformStream> make_stream() const final;
 };
 
 //This class implements serialization of form data to application/x-www-form-urlencoded
@@ -21,5 +22,7 @@ public:
 	bool reverse_transform() const final;
 	std::unique_ptr<Transform> get_reverse_transform() const final;
 	std::unique_ptr<Document> transform(const Document& input) const final;
+	std::unique_ptr<Document> transform_incremental(const Document& input, std::unique_ptr<Document> previous_output) const final;
 	const std::string get_description() const final;
+	std::unique_ptr<TransformStream> make_stream() const final;
 };	
\ No newline at end of file
@@ -1,5 +1,207 @@
 #include "utf.h"
 
+#include <algorithm>
+#include <array>
+
+#include "../utf8_simd.h"
+#include "../progress.h"
+
+//Throws the TransformError describing the invalid UTF-8 sequence starting at it,
+//which is at the given offset of the whole input
+static void throw_invalid_utf8(size_t offset, const char* it, const char* end)
+{
+	std::string at = " (at byte " + std::to_string(offset) + ")";
+	switch (utf8::internal::validate_next(it, end))
+	{
+	case utf8::internal::INVALID_CODE_POINT:
+		throw TransformError("UTF-8 Decoder encountered an invalid code point" + at);
+	case utf8::internal::NOT_ENOUGH_ROOM:
+		throw TransformError("End of file in the middle of UTF-8 char" + at);
+	default:
+		throw TransformError("Input is not a valid UTF-8 document" + at);
+	}
+}
+
+UnicodeString decode_utf8(const char* data, size_t len)
+{
+	//Validate the whole input in vectorized passes, so decoding can skip all checks. The blocks
+	//end at the start of a char, so no sequence is split between two of them.
+	for (size_t pos = 0; pos < len;)
+	{
+		size_t end = std::min(pos + progress_block, len);
+		while (end < len && ((unsigned char)data[end] & 0xC0) == 0x80)
+		{
+			end++;
+		}
+		size_t invalid = pos + utf8::first_invalid(data + pos, end - pos);
+		if (invalid != end)
+		{
+			throw_invalid_utf8(invalid, data + invalid, data + len);
+		}
+		pos = end;
+		report_progress(pos, len);
+	}
+	return utf8::decode_valid(data, len);
+}
+
+//Returns the UTF-8 length of count codepoints starting at pos, throwing TransformError
+//if they cannot be encoded. offset is the position of the string in the whole input.
+static size_t checked_encoded_length(const UnicodeString& str, size_t pos, size_t count, size_t offset)
+{
+	size_t invalid;
+	size_t length = utf8::encoded_length(str, pos, count, invalid);
+	if (invalid != pos + count)
+	{
+		throw TransformError("UTF-8 Encoder encountered an invalid code point (at char " + std::to_string(offset + invalid) + ")");
+	}
+	return length;
+}
+
+static void encode_utf8(const UnicodeString& str, size_t offset, OctetBuffer& out)
+{
+	size_t length = checked_encoded_length(str, 0, str.size(), offset);
+	//The encoder needs some slack at the end of the buffer
+	out.resize(length + 16);
+	char* end = out.mutable_data();
+	for (size_t pos = 0; pos < str.size(); pos += progress_block)
+	{
+		size_t count = std::min(progress_block, str.size() - pos);
+		end = utf8::encode_valid(str, pos, count, end);
+		report_progress(pos + count, str.size());
+	}
+	out.resize(end - out.data());
+}
+
+void encode_utf8(const UnicodeString& str, OctetBuffer& out)
+{
+	encode_utf8(str, 0, out);
+}
+
+void write_utf8(const UnicodeString& str, std::ostream& output)
+{
+	checked_encoded_length(str, 0, str.size(), 0);
+	const size_t block = 16384;
+	std::vector<char> buffer(block * 4 + 16);
+	for (size_t pos = 0; pos < str.size(); pos += block)
+	{
+		size_t count = std::min(block, str.size() - pos);
+		char* end = utf8::encode_valid(str, pos, count, buffer.data());
+		output.write(buffer.data(), end - buffer.data());
+	}
+}
+
+//Decodes UTF-8 chunk by chunk, carrying a char split between chunks
+class UTF8DecodeStream : public TransformStream
+{
+	std::array<char, 4> partial;
+	size_t partial_len = 0;
+	//Offset of the next byte (or the carried partial char) in the whole input
+	size_t offset = 0;
+
+	//Completes the carried char with bytes from the input.
+	//Returns false if the input ended before the char did.
+	bool complete_partial(const char*& data, size_t& len, UnicodeString& out)
+	{
+		size_t needed = utf8::internal::sequence_length(partial.begin());
+		size_t taken = std::min(needed - partial_len, len);
+		std::copy(data, data + taken, partial.begin() + partial_len);
+		partial_len += taken;
+		data += taken;
+		len -= taken;
+		if (partial_len < needed)
+		{
+			return false;
+		}
+		out = decode_utf8_at(partial.data(), partial_len);
+		partial_len = 0;
+		return true;
+	}
+
+	UnicodeString decode_utf8_at(const char* data, size_t len)
+	{
+		size_t invalid = utf8::first_invalid(data, len);
+		if (invalid != len)
+		{
+			throw_invalid_utf8(offset + invalid, data + invalid, data + len);
+		}
+		offset += len;
+		return utf8::decode_valid(data, len);
+	}
+public:
+	std::unique_ptr<Document> push(const Document& chunk) final
+	{
+		if (chunk.get_type() != OctetDocumentType)
+		{
+			throw TransformError("UTF-8 Decoder only accepts octet documents");
+		}
+		const OctetBuffer& input = dynamic_cast<const OctetDocument&>(chunk).data;
+		const char* data = input.data();
+		size_t len = input.size();
+
+		std::unique_ptr<UnicodeDocument> result = std::make_unique<UnicodeDocument>();
+		if (partial_len && !complete_partial(data, len, result->data))
+		{
+			return move(result);
+		}
+
+		//A char running past the end of the chunk is carried over, anything else invalid is an error
+		size_t valid = utf8::first_invalid(data, len);
+		if (valid != len)
+		{
+			const char* it = data + valid;
+			if (utf8::internal::validate_next(it, data + len) != utf8::internal::NOT_ENOUGH_ROOM)
+			{
+				throw_invalid_utf8(offset + valid, data + valid, data + len);
+			}
+			partial_len = len - valid;
+			std::copy(data + valid, data + len, partial.begin());
+		}
+
+		if (result->data.empty())
+		{
+			result->data = decode_utf8_at(data, valid);
+		}
+		else {
+			result->data.append(decode_utf8_at(data, valid));
+		}
+		return move(result);
+	}
+
+	std::unique_ptr<Document> finish() final
+	{
+		if (partial_len)
+		{
+			throw_invalid_utf8(offset, partial.data(), partial.data() + partial_len);
+		}
+		return std::make_unique<UnicodeDocument>();
+	}
+};
+
+//Encodes unicode chunk by chunk, nothing needs to be carried over
+class UTF8EncodeStream : public TransformStream
+{
+	size_t offset = 0;
+public:
+	std::unique_ptr<Document> push(const Document& chunk) final
+	{
+		if (chunk.get_type() != UnicodeDocumentType)
+		{
+			throw TransformError("UTF-8 Encoder only accepts unicode documents");
+		}
+		const UnicodeString& input = dynamic_cast<const UnicodeDocument&>(chunk).data;
+
+		std::unique_ptr<OctetDocument> result = std::make_unique<OctetDocument>();
+		encode_utf8(input, offset, result->data);
+		offset += input.size();
+		return move(result);
+	}
+
+	std::unique_ptr<Document> finish() final
+	{
+		return std::make_unique<OctetDocument>();
+	}
+};
+
 bool UTF8Decode::accepts_type(DocType type) const
 {
 	return type == OctetDocumentType;
@@ -24,26 +226,8 @@ std::unique_ptr<Document> UTF8Decode::transform(const Document& input) const
 	const OctetDocument& doc = dynamic_cast<const OctetDocument&>(input);
 
 	std::unique_ptr<UnicodeDocument> result = std::make_unique<UnicodeDocument>();
-	
-
-	try {
-		for (auto it = doc.data.begin(); it != doc.data.end();)
-		{
-			result->data.push_back(utf8::next(it, doc.data.end()));
-		}
-	}
-	catch (const utf8::invalid_code_point &)
-	{
-		throw TransformError("UTF-8 Decoder encountered an invalid code point");
-	}
-	catch (const utf8::not_enough_room &)
-	{
-		throw TransformError("End of file in the middle of UTF-8 char");
-	}
-	catch (const utf8::invalid_utf8 &)
-	{
-		throw TransformError("Input is not a valid UTF-8 document");
-	}
+	//Shared, so that parts decoded from the text refer to it instead of copying it
+	result->data = UnicodeString::shared(decode_utf8(doc.data.data(), doc.data.size()));
 
 	return move(result);
 	
@@ -54,6 +238,11 @@ const std::string UTF8Decode::get_description() const
 	return "UTF-8";
 }
 
+std::unique_ptr<TransformStream> UTF8Decode::make_stream() const
+{
+	return std::make_unique<UTF8DecodeStream>();
+}
+
 bool UTF8Encode::accepts_type(DocType type) const
 {
 	return type == UnicodeDocumentType;
@@ -78,25 +267,52 @@ std::unique_ptr<Document> UTF8Encode::transform(const Document& input) const
 	const UnicodeDocument& doc = dynamic_cast<const UnicodeDocument&>(input);
 
 	std::unique_ptr<OctetDocument> result = std::make_unique<OctetDocument>();
+	encode_utf8(doc.data, result->data);
 
+	return move(result);
+}
 
-	auto inserter =  std::back_inserter(result->data);
+std::unique_ptr<Document> UTF8Encode::transform_incremental(const Document& input, std::unique_ptr<Document> previous_output) const
+{
+	if (!input.is_dirty() || input.get_type() != UnicodeDocumentType || previous_output->get_type() != OctetDocumentType)
+	{
+		return Transform::transform_incremental(input, std::move(previous_output));
+	}
+	const UnicodeString& str = dynamic_cast<const UnicodeDocument&>(input).data;
+	OctetBuffer& output = dynamic_cast<OctetDocument&>(*previous_output).data;
 
-	try {
-		for (auto&& cp : doc.data)
-		{
-			utf8::append(cp, inserter);
-		}
+	//Valid UTF-8 has a single encoding of every codepoint, so the unchanged
+	//codepoints were decoded from bytes the encoder would produce for them
+	size_t prefix = input.get_clean_prefix();
+	size_t suffix = input.get_clean_suffix();
+	size_t middle = str.size() - prefix - suffix;
+	//Splicing costs a copy of the output, which only pays off if most of it is kept
+	if (middle > prefix + suffix)
+	{
+		return Transform::transform_incremental(input, std::move(previous_output));
 	}
-	catch (utf8::invalid_code_point)
+	size_t invalid;
+	size_t prefix_bytes = utf8::encoded_length(str, 0, prefix, invalid);
+	size_t suffix_bytes = utf8::encoded_length(str, prefix + middle, suffix, invalid);
+	if (prefix_bytes + suffix_bytes > output.size())
 	{
-		throw TransformError("UTF-8 Encoder encountered an invalid code point");
+		return Transform::transform_incremental(input, std::move(previous_output));
 	}
 
-	return move(result);
+	OctetBuffer encoded;
+	encoded.resize(checked_encoded_length(str, prefix, middle, 0) + 16);
+	char* end = utf8::encode_valid(str, prefix, middle, encoded.mutable_data());
+	output.replace(prefix_bytes, output.size() - prefix_bytes - suffix_bytes, encoded.data(), end - encoded.data());
+	previous_output->mark_dirty(prefix_bytes, suffix_bytes);
+	return previous_output;
 }
 
 const std::string UTF8Encode::get_description() const
 {
 	return "UTF-8";
 }
+
+std::unique_ptr<TransformStream> UTF8Encode::make_stream() const
+{
+	return std::make_unique<UTF8EncodeStream>();
+}
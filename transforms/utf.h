@@ -2,6 +2,16 @@
 
 #include "../transform.h"
 
+//Decodes a UTF-8 encoded buffer, throwing TransformError if it is not valid UTF-8
+UnicodeString decode_utf8(const char* data, size_t len);
+
+//Encodes unicode codepoints as UTF-8, throwing TransformError if some cannot be encoded
+void encode_utf8(const UnicodeString& str, OctetBuffer& out);
+
+//Writes unicode codepoints to the stream as UTF-8 in large blocks,
+//throwing TransformError if some cannot be encoded
+void write_utf8(const UnicodeString& str, std::ostream& output);
+
 //Implements decoding UTF-8 encoded unicode documents
 class UTF8Decode : public Transform {
 public:
@@ -10,6 +20,7 @@ public:
 	std::unique_ptr<Transform> get_reverse_transform() const final;
 	std::unique_ptr<Document> transform(const Document& input) const final;
 	const std::string get_description() const final;
+	std::unique_ptr<TransformStream> make_stream() const final;
 };
 
 //Implements encoding unicode documents using UTF-8
@@ -19,5 +30,7 @@ public:
 	bool reverse_transform() const final;
 	std::unique_ptr<Transform> get_reverse_transform() const final;
 	std::unique_ptr<Document> transform(const Document& input) const final;
+	std::unique_ptr<Document> transform_incremental(const Document& input, std::unique_ptr<Document> previous_output) const final;
 	const std::string get_description() const final;
+	std::unique_ptr<TransformStream> make_stream() const final;
 };
\ No newline at end of file
@@ -0,0 +1,344 @@
+#include "unicode_string.h"
+
+#include <algorithm>
+
+UnicodeString& UnicodeString::operator=(UnicodeString&& other) noexcept
+{
+	if (this != &other)
+	{
+		latin1 = std::move(other.latin1);
+		ucs2 = std::move(other.ucs2);
+		utf32 = std::move(other.utf32);
+		cpwidth = other.cpwidth;
+		backing = std::move(other.backing);
+		view_offset = other.view_offset;
+		view_size = other.view_size;
+		gap_start = other.gap_start;
+		gap_length = other.gap_length;
+		other.clear();
+	}
+	return *this;
+}
+
+void UnicodeString::widen(unsigned char to)
+{
+	if (to <= cpwidth)
+	{
+		return;
+	}
+	if (to == 2)
+	{
+		ucs2.assign(latin1.begin(), latin1.end());
+	}
+	else if (cpwidth == 1)
+	{
+		utf32.assign(latin1.begin(), latin1.end());
+	}
+	else {
+		utf32.assign(ucs2.begin(), ucs2.end());
+	}
+	latin1_vector().swap(latin1);
+	if (to == 4)
+	{
+		ucs2_vector().swap(ucs2);
+	}
+	cpwidth = to;
+}
+
+template <typename vector>
+static void erase_gap(vector& v, size_t gap_start, size_t gap_length)
+{
+	v.erase(v.begin() + gap_start, v.begin() + gap_start + gap_length);
+}
+
+void UnicodeString::close_gap()
+{
+	if (gap_length == 0)
+	{
+		return;
+	}
+	switch (cpwidth)
+	{
+	case 1:
+		erase_gap(latin1, gap_start, gap_length);
+		break;
+	case 2:
+		erase_gap(ucs2, gap_start, gap_length);
+		break;
+	default:
+		erase_gap(utf32, gap_start, gap_length);
+		break;
+	}
+	gap_start = 0;
+	gap_length = 0;
+}
+
+void UnicodeString::detach()
+{
+	if (owns_backing())
+	{
+		//Backings are never created const, and nothing else reads this one
+		std::shared_ptr<const UnicodeString> from = std::move(backing);
+		*this = std::move(const_cast<UnicodeString&>(*from));
+		return;
+	}
+	std::shared_ptr<const UnicodeString> from = std::move(backing);
+	*this = from->substr(view_offset, view_size);
+}
+
+UnicodeString UnicodeString::view(const std::shared_ptr<const UnicodeString>& backing, size_t pos, size_t count)
+{
+	if (backing->backing)
+	{
+		return view(backing->backing, backing->view_offset + pos, count);
+	}
+	if (backing->gap_length > 0)
+	{
+		//Views read the storage in one run, of a string being edited they are a copy
+		return backing->substr(pos, count);
+	}
+	UnicodeString s;
+	s.backing = backing;
+	s.view_offset = pos;
+	s.view_size = count;
+	s.cpwidth = backing->cpwidth;
+	return s;
+}
+
+UnicodeString UnicodeString::shared(UnicodeString&& string)
+{
+	if (string.backing)
+	{
+		return std::move(string);
+	}
+	string.close_gap();
+	std::shared_ptr<const UnicodeString> backing = std::make_shared<UnicodeString>(std::move(string));
+	return view(backing, 0, backing->size());
+}
+
+UnicodeString UnicodeString::from_latin1(latin1_vector&& data)
+{
+	UnicodeString s;
+	s.latin1 = std::move(data);
+	s.cpwidth = 1;
+	return s;
+}
+
+UnicodeString UnicodeString::from_ucs2(ucs2_vector&& data)
+{
+	UnicodeString s;
+	s.ucs2 = std::move(data);
+	s.cpwidth = 2;
+	return s;
+}
+
+UnicodeString UnicodeString::from_utf32(utf32_vector&& data)
+{
+	UnicodeString s;
+	s.utf32 = std::move(data);
+	s.cpwidth = 4;
+	return s;
+}
+
+size_t UnicodeString::size() const
+{
+	if (backing)
+	{
+		return view_size;
+	}
+	switch (cpwidth)
+	{
+	case 1:
+		return latin1.size() - gap_length;
+	case 2:
+		return ucs2.size() - gap_length;
+	default:
+		return utf32.size() - gap_length;
+	}
+}
+
+bool UnicodeString::empty() const
+{
+	return size() == 0;
+}
+
+void UnicodeString::append(const UnicodeString& other)
+{
+	if (backing)
+	{
+		detach();
+	}
+	close_gap();
+	if (other.cpwidth > cpwidth)
+	{
+		widen(other.cpwidth);
+	}
+	reserve(size() + other.size());
+	other.visit_runs(0, other.size(), [this](auto begin, auto end, size_t) {
+		switch (cpwidth)
+		{
+		case 1:
+			latin1.insert(latin1.end(), begin, end);
+			break;
+		case 2:
+			ucs2.insert(ucs2.end(), begin, end);
+			break;
+		default:
+			utf32.insert(utf32.end(), begin, end);
+			break;
+		}
+	});
+}
+
+//Copies count codepoints from pos on, those before the gap and then those after it
+template <typename vector>
+static vector copy_range(const vector& v, size_t gap_start, size_t gap_length, size_t pos, size_t count)
+{
+	vector result;
+	result.reserve(count);
+	size_t before = pos < gap_start ? std::min(count, gap_start - pos) : 0;
+	result.insert(result.end(), v.begin() + pos, v.begin() + pos + before);
+	result.insert(result.end(), v.begin() + pos + before + gap_length, v.begin() + pos + count + gap_length);
+	return result;
+}
+
+UnicodeString UnicodeString::substr(size_t pos, size_t count) const
+{
+	if (backing)
+	{
+		return backing->substr(view_offset + pos, count);
+	}
+	switch (cpwidth)
+	{
+	case 1:
+		return from_latin1(copy_range(latin1, gap_start, gap_length, pos, count));
+	case 2:
+		return from_ucs2(copy_range(ucs2, gap_start, gap_length, pos, count));
+	default:
+		return from_utf32(copy_range(utf32, gap_start, gap_length, pos, count));
+	}
+}
+
+//Codepoints the gap grows by at least, so typing doesn't grow it at every codepoint
+static const size_t min_gap = 4096;
+
+template <typename vector, typename iterator>
+static void replace_at_gap(vector& v, size_t& gap_start, size_t& gap_length, size_t pos, size_t count, iterator first, iterator last)
+{
+	size_t n = last - first;
+	if (gap_length == 0)
+	{
+		gap_start = v.size();
+	}
+	if (gap_length + count < n)
+	{
+		//Moves the codepoints after the gap once for many edits
+		size_t grow = n - count - gap_length + std::max(v.size() / 64, min_gap);
+		v.insert(v.begin() + gap_start, grow, 0);
+		gap_length += grow;
+	}
+	//Only the codepoints between the gap and pos move
+	if (pos < gap_start)
+	{
+		std::move_backward(v.begin() + pos, v.begin() + gap_start, v.begin() + gap_start + gap_length);
+	}
+	else {
+		std::move(v.begin() + gap_start + gap_length, v.begin() + pos + gap_length, v.begin() + gap_start);
+	}
+	//The replaced codepoints now follow the gap and join it, the new ones fill its start
+	gap_start = pos;
+	gap_length += count;
+	std::copy(first, last, v.begin() + gap_start);
+	gap_start += n;
+	gap_length -= n;
+}
+
+void UnicodeString::replace(size_t pos, size_t count, const UnicodeString& other)
+{
+	if (backing)
+	{
+		detach();
+	}
+	if (other.cpwidth > cpwidth)
+	{
+		widen(other.cpwidth);
+	}
+	other.visit([&](auto first, auto last) {
+		switch (cpwidth)
+		{
+		case 1:
+			replace_at_gap(latin1, gap_start, gap_length, pos, count, first, last);
+			break;
+		case 2:
+			replace_at_gap(ucs2, gap_start, gap_length, pos, count, first, last);
+			break;
+		default:
+			replace_at_gap(utf32, gap_start, gap_length, pos, count, first, last);
+			break;
+		}
+	});
+}
+
+void UnicodeString::reserve(size_t count)
+{
+	if (backing)
+	{
+		detach();
+	}
+	close_gap();
+	switch (cpwidth)
+	{
+	case 1:
+		latin1.reserve(count);
+		break;
+	case 2:
+		ucs2.reserve(count);
+		break;
+	default:
+		utf32.reserve(count);
+		break;
+	}
+}
+
+void UnicodeString::clear()
+{
+	backing.reset();
+	gap_start = 0;
+	gap_length = 0;
+	latin1.clear();
+	ucs2_vector().swap(ucs2);
+	utf32_vector().swap(utf32);
+	cpwidth = 1;
+}
+
+size_t UnicodeString::hash() const
+{
+	//FNV-1a over the codepoints
+	std::uint64_t h = 14695981039346656037ULL;
+	visit([&](auto begin, auto end) {
+		for (auto it = begin; it != end; ++it)
+		{
+			h = (h ^ *it) * 1099511628211ULL;
+		}
+	});
+	//Mix the high bits into the low ones, which hash tables use
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return (size_t)h;
+}
+
+bool UnicodeString::operator==(const UnicodeString& other) const
+{
+	return size() == other.size() && std::equal(begin(), end(), other.begin());
+}
+
+bool UnicodeString::operator<(const UnicodeString& other) const
+{
+	return std::lexicographical_compare(begin(), end(), other.begin(), other.end());
+}
+
+bool UnicodeString::starts_with(const UnicodeString& prefix) const
+{
+	return size() >= prefix.size() && std::equal(prefix.begin(), prefix.end(), begin());
+}
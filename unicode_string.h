@@ -0,0 +1,254 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <iterator>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+
+#include "utf8.h"
+#include "uninitialized_allocator.h"
+
+//Sequence of unicode codepoints. All codepoints are stored with the same width,
+//which is the narrowest one able to hold every codepoint of the sequence:
+//* 1 byte (Latin-1)
+//* 2 bytes (UCS-2, only the Basic Multilingual Plane)
+//* 4 bytes (UTF-32)
+//Mostly-ASCII text thus takes a single byte per codepoint while indexing stays O(1).
+//A string can also be a view of a range of a shared string, which it copies to
+//its own storage before it is modified.
+//Replacing codepoints leaves a gap in the storage where the edit was, which the next
+//edit moves to its own position, so that edits close to each other only move the
+//codepoints between them. Reading never changes the string, so several threads can
+//read it at once: visit_runs() reads around the gap, visit() needs the codepoints in
+//one run and reads a copy of them while there is a gap. Whoever edits a string thus
+//calls close_gap() once done.
+class UnicodeString
+{
+public:
+	typedef std::vector<std::uint8_t, uninitialized_allocator<std::uint8_t>> latin1_vector;
+	typedef std::vector<std::uint16_t, uninitialized_allocator<std::uint16_t>> ucs2_vector;
+	typedef std::vector<utf8::uint32_t, uninitialized_allocator<utf8::uint32_t>> utf32_vector;
+private:
+	latin1_vector latin1;
+	ucs2_vector ucs2;
+	utf32_vector utf32;
+	unsigned char cpwidth = 1;
+	//Unused storage from gap_start on, the codepoints after it follow the gap
+	size_t gap_start = 0;
+	size_t gap_length = 0;
+	//Set for views, which leave the vectors empty
+	std::shared_ptr<const UnicodeString> backing;
+	size_t view_offset = 0;
+	size_t view_size = 0;
+
+	//Moves the contents to a storage with the supplied width
+	void widen(unsigned char to);
+	//Copies the contents of a view to own storage
+	void detach();
+	//Set for a view of all of a backing that nothing else refers to
+	bool owns_backing() const { return backing.use_count() == 1 && view_offset == 0 && view_size == backing->size(); }
+
+	//Calls f(begin, end, pos) for count codepoints of the storage from offset on,
+	//whose first one is at pos in the string
+	template <typename function>
+	void visit_storage(size_t offset, size_t count, size_t pos, function& f) const
+	{
+		//Views always refer to a string with its own storage
+		const UnicodeString& storage = backing ? *backing : *this;
+		switch (cpwidth)
+		{
+		case 1:
+			f(storage.latin1.data() + offset, storage.latin1.data() + offset + count, pos);
+			break;
+		case 2:
+			f(storage.ucs2.data() + offset, storage.ucs2.data() + offset + count, pos);
+			break;
+		default:
+			f(storage.utf32.data() + offset, storage.utf32.data() + offset + count, pos);
+			break;
+		}
+	}
+public:
+	class const_iterator
+	{
+		const UnicodeString* str = nullptr;
+		size_t pos = 0;
+	public:
+		typedef std::random_access_iterator_tag iterator_category;
+		typedef utf8::uint32_t value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const utf8::uint32_t* pointer;
+		typedef utf8::uint32_t reference;
+
+		const_iterator() = default;
+		const_iterator(const UnicodeString* str, size_t pos) : str(str), pos(pos) {}
+
+		utf8::uint32_t operator*() const { return (*str)[pos]; }
+		utf8::uint32_t operator[](difference_type n) const { return (*str)[pos + n]; }
+		const_iterator& operator++() { pos++; return *this; }
+		const_iterator operator++(int) { const_iterator tmp = *this; pos++; return tmp; }
+		const_iterator& operator--() { pos--; return *this; }
+		const_iterator operator--(int) { const_iterator tmp = *this; pos--; return tmp; }
+		const_iterator& operator+=(difference_type n) { pos += n; return *this; }
+		const_iterator& operator-=(difference_type n) { pos -= n; return *this; }
+		const_iterator operator+(difference_type n) const { return const_iterator(str, pos + n); }
+		const_iterator operator-(difference_type n) const { return const_iterator(str, pos - n); }
+		difference_type operator-(const const_iterator& other) const { return (difference_type)pos - (difference_type)other.pos; }
+		bool operator==(const const_iterator& other) const { return pos == other.pos; }
+		bool operator!=(const const_iterator& other) const { return pos != other.pos; }
+		bool operator<(const const_iterator& other) const { return pos < other.pos; }
+		bool operator>(const const_iterator& other) const { return pos > other.pos; }
+		bool operator<=(const const_iterator& other) const { return pos <= other.pos; }
+		bool operator>=(const const_iterator& other) const { return pos >= other.pos; }
+	};
+
+	UnicodeString() = default;
+	UnicodeString(const UnicodeString&) = default;
+	UnicodeString& operator=(const UnicodeString&) = default;
+	//Moving leaves the other string empty, including its gap
+	UnicodeString(UnicodeString&& other) noexcept { *this = std::move(other); }
+	UnicodeString& operator=(UnicodeString&& other) noexcept;
+
+	template <typename iterator>
+	UnicodeString(iterator first, iterator last)
+	{
+		append(first, last);
+	}
+
+	//Returns the number of bytes needed to store the codepoint
+	static unsigned char width_of(utf8::uint32_t codepoint)
+	{
+		return codepoint < 0x100 ? 1 : (codepoint < 0x10000 ? 2 : 4);
+	}
+
+	//Takes over already encoded codepoints of the given width
+	static UnicodeString from_latin1(latin1_vector&& data);
+	static UnicodeString from_ucs2(ucs2_vector&& data);
+	static UnicodeString from_utf32(utf32_vector&& data);
+	//Returns a view of count codepoints of the backing string starting at pos
+	static UnicodeString view(const std::shared_ptr<const UnicodeString>& backing, size_t pos, size_t count);
+	//Moves the string to a backing of its own and returns a view of all of it, so that
+	//copies of it and views of its ranges share the codepoints instead of copying them
+	static UnicodeString shared(UnicodeString&& string);
+
+	size_t size() const;
+	bool empty() const;
+	unsigned char width() const { return cpwidth; }
+	bool is_view() const { return backing != nullptr; }
+	//Returns the number of bytes of storage owned by the string. A view owns the storage
+	//only while it is the whole backing and no other string refers to it.
+	size_t memory_usage() const { return backing ? (owns_backing() ? backing->memory_usage() : 0) : size() * cpwidth; }
+
+	utf8::uint32_t operator[](size_t pos) const
+	{
+		if (backing)
+		{
+			return (*backing)[view_offset + pos];
+		}
+		if (pos >= gap_start)
+		{
+			pos += gap_length;
+		}
+		switch (cpwidth)
+		{
+		case 1:
+			return latin1[pos];
+		case 2:
+			return ucs2[pos];
+		default:
+			return utf32[pos];
+		}
+	}
+
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, size()); }
+
+	void push_back(utf8::uint32_t codepoint)
+	{
+		if (backing)
+		{
+			detach();
+		}
+		close_gap();
+		if (width_of(codepoint) > cpwidth)
+		{
+			widen(width_of(codepoint));
+		}
+		switch (cpwidth)
+		{
+		case 1:
+			latin1.push_back((std::uint8_t)codepoint);
+			break;
+		case 2:
+			ucs2.push_back((std::uint16_t)codepoint);
+			break;
+		default:
+			utf32.push_back(codepoint);
+			break;
+		}
+	}
+
+	template <typename iterator>
+	void append(iterator first, iterator last)
+	{
+		for (; first != last; ++first)
+		{
+			push_back(*first);
+		}
+	}
+
+	void append(const UnicodeString& other);
+	//Returns count codepoints starting at pos, stored with the same width
+	UnicodeString substr(size_t pos, size_t count) const;
+	//Replaces count codepoints at pos with the other string
+	void replace(size_t pos, size_t count, const UnicodeString& other);
+	void reserve(size_t count);
+	void clear();
+	//Moves the codepoints after the gap left by edits to its start
+	void close_gap();
+
+	//Calls f(begin, end) with pointers to the raw storage, whose type is
+	//std::uint8_t, std::uint16_t or utf8::uint32_t depending on width()
+	template <typename function>
+	void visit(function&& f) const
+	{
+		if (gap_length > 0)
+		{
+			substr(0, size()).visit(f);
+			return;
+		}
+		auto whole = [&](auto begin, auto end, size_t) { f(begin, end); };
+		visit_storage(backing ? view_offset : 0, size(), 0, whole);
+	}
+
+	//Calls f(begin, end, pos) like visit for the count codepoints from pos on, once
+	//for those before the gap and once for those after it, where pos is the position
+	//of begin. Unlike visit, this leaves the gap where it is.
+	template <typename function>
+	void visit_runs(size_t pos, size_t count, function&& f) const
+	{
+		if (backing)
+		{
+			visit_storage(view_offset + pos, count, pos, f);
+			return;
+		}
+		if (pos < gap_start && pos + count > gap_start)
+		{
+			visit_storage(pos, gap_start - pos, pos, f);
+			count -= gap_start - pos;
+			pos = gap_start;
+		}
+		visit_storage(pos >= gap_start ? pos + gap_length : pos, count, pos, f);
+	}
+
+	//Hash of the codepoints, which doesn't depend on the width they are stored with
+	size_t hash() const;
+
+	bool operator==(const UnicodeString& other) const;
+	bool operator!=(const UnicodeString& other) const { return !(*this == other); }
+	//Orders by codepoints, like std::string does by chars
+	bool operator<(const UnicodeString& other) const;
+	bool starts_with(const UnicodeString& prefix) const;
+};
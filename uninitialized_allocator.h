@@ -0,0 +1,39 @@
+#pragma once
+
+#include <memory>
+#include <new>
+#include <utility>
+
+//Allocator that default-initializes elements instead of value-initializing them.
+//For plain integer types this means resize() leaves the new elements uninitialized,
+//so a buffer can be sized up front and every element written exactly once.
+template <typename T>
+class uninitialized_allocator : public std::allocator<T>
+{
+public:
+	template <typename U>
+	struct rebind
+	{
+		typedef uninitialized_allocator<U> other;
+	};
+
+	uninitialized_allocator() = default;
+
+	template <typename U>
+	uninitialized_allocator(const uninitialized_allocator<U>&)
+	{
+
+	}
+
+	template <typename U>
+	void construct(U* p)
+	{
+		::new ((void*)p) U;
+	}
+
+	template <typename U, typename... Args>
+	void construct(U* p, Args&&... args)
+	{
+		::new ((void*)p) U(std::forward<Args>(args)...);
+	}
+};
@@ -0,0 +1,641 @@
+#include "utf8_simd.h"
+
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <algorithm>
+
+#include "utf8.h"
+#include "simd.h"
+#include "progress.h"
+
+//Scalar validation with a fast path skipping 8 ASCII bytes at a time
+static size_t first_invalid_scalar(const char* data, size_t len)
+{
+	size_t pos = 0;
+	while (pos < len)
+	{
+		while (pos + 8 <= len)
+		{
+			std::uint64_t word;
+			memcpy(&word, data + pos, 8);
+			if (word & 0x8080808080808080ull)
+			{
+				break;
+			}
+			pos += 8;
+		}
+		if (pos >= len)
+		{
+			break;
+		}
+		if ((unsigned char)data[pos] < 0x80)
+		{
+			pos++;
+			continue;
+		}
+		const char* it = data + pos;
+		if (utf8::internal::validate_next(it, data + len) != utf8::internal::UTF8_OK)
+		{
+			return pos;
+		}
+		pos = it - data;
+	}
+	return len;
+}
+
+//Counts the codepoints (non-continuation bytes) and finds the largest byte
+static void measure_scalar(const char* data, size_t len, size_t& codepoints, unsigned char& max_byte)
+{
+	for (size_t pos = 0; pos < len; pos++)
+	{
+		unsigned char c = (unsigned char)data[pos];
+		codepoints += (c & 0xC0) != 0x80;
+		max_byte = std::max(max_byte, c);
+	}
+}
+
+template <typename T>
+static T* decode_scalar(const char* in, const char* end, T* out)
+{
+	while (in != end)
+	{
+		*out++ = (T)utf8::unchecked::next(in);
+	}
+	return out;
+}
+
+template <typename T>
+static size_t encoded_length_scalar(const T* begin, const T* it, const T* end, size_t& invalid)
+{
+	size_t length = 0;
+	for (; it != end; ++it)
+	{
+		utf8::uint32_t cp = *it;
+		if (!utf8::internal::is_code_point_valid(cp))
+		{
+			invalid = it - begin;
+			return length;
+		}
+		length += cp < 0x80 ? 1 : (cp < 0x800 ? 2 : (cp < 0x10000 ? 3 : 4));
+	}
+	invalid = end - begin;
+	return length;
+}
+
+template <typename T>
+static char* encode_scalar(const T* it, const T* end, char* out)
+{
+	for (; it != end; ++it)
+	{
+		out = utf8::unchecked::append(*it, out);
+	}
+	return out;
+}
+
+#ifdef SIMD_X86
+
+//The kernel is the lookup algorithm from John Keiser and Daniel Lemire:
+//Validating UTF-8 In Less Than One Instruction Per Byte (https://arxiv.org/abs/2010.03090)
+//Every error shows up in a combination of the high nibble of a byte and the
+//high and low nibble of the preceding one, which is checked using three
+//pshufb table lookups.
+
+static const std::uint8_t TOO_SHORT = 1 << 0;
+static const std::uint8_t TOO_LONG = 1 << 1;
+static const std::uint8_t OVERLONG_3 = 1 << 2;
+static const std::uint8_t TOO_LARGE = 1 << 3;
+static const std::uint8_t SURROGATE = 1 << 4;
+static const std::uint8_t OVERLONG_2 = 1 << 5;
+static const std::uint8_t TOO_LARGE_1000 = 1 << 6;
+static const std::uint8_t OVERLONG_4 = 1 << 6;
+static const std::uint8_t TWO_CONTS = 1 << 7;
+static const std::uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+//Returns the input shifted by n bytes, with the last bytes of prev shifted in
+#define UTF8_PREV(input, prev, n) _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev, input, 0x21), 16 - n)
+
+SIMD_TARGET("avx2")
+static inline __m256i check_block(__m256i input, __m256i prev_input)
+{
+	const __m256i byte_1_high_table = _mm256_setr_epi8(
+		TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+		TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+		TOO_SHORT | OVERLONG_2, TOO_SHORT, TOO_SHORT | OVERLONG_3 | SURROGATE, (char)(TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4),
+		TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+		TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+		TOO_SHORT | OVERLONG_2, TOO_SHORT, TOO_SHORT | OVERLONG_3 | SURROGATE, (char)(TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4));
+	const __m256i byte_1_low_table = _mm256_setr_epi8(
+		CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY, CARRY,
+		CARRY | TOO_LARGE, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY, CARRY,
+		CARRY | TOO_LARGE, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000);
+	const __m256i byte_2_high_table = _mm256_setr_epi8(
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+		(char)(TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4),
+		(char)(TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE),
+		(char)(TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE),
+		(char)(TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE),
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+		(char)(TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4),
+		(char)(TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE),
+		(char)(TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE),
+		(char)(TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE),
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+	const __m256i nibble_mask = _mm256_set1_epi8(0x0f);
+
+	__m256i prev1 = UTF8_PREV(input, prev_input, 1);
+	__m256i byte_1_high = _mm256_shuffle_epi8(byte_1_high_table, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble_mask));
+	__m256i byte_1_low = _mm256_shuffle_epi8(byte_1_low_table, _mm256_and_si256(prev1, nibble_mask));
+	__m256i byte_2_high = _mm256_shuffle_epi8(byte_2_high_table, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble_mask));
+	__m256i special_cases = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+	//The 3rd and 4th byte of a sequence must be continuations, which the lookup can't see
+	__m256i prev2 = UTF8_PREV(input, prev_input, 2);
+	__m256i prev3 = UTF8_PREV(input, prev_input, 3);
+	__m256i is_third_byte = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xe0 - 0x80)));
+	__m256i is_fourth_byte = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xf0 - 0x80)));
+	__m256i must23_80 = _mm256_and_si256(_mm256_or_si256(is_third_byte, is_fourth_byte), _mm256_set1_epi8((char)0x80));
+	return _mm256_xor_si256(must23_80, special_cases);
+}
+
+//Returns non-zero bytes where a sequence starting in the last 3 bytes of the block is incomplete
+SIMD_TARGET("avx2")
+static inline __m256i check_incomplete(__m256i input)
+{
+	const __m256i max_value = _mm256_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1));
+	return _mm256_subs_epu8(input, max_value);
+}
+
+SIMD_TARGET("avx2")
+static size_t first_invalid_avx2(const char* data, size_t len)
+{
+	__m256i prev_input = _mm256_setzero_si256();
+	__m256i prev_incomplete = _mm256_setzero_si256();
+	size_t pos = 0;
+	bool failed = false;
+
+	for (; pos < len; pos += 32)
+	{
+		__m256i input;
+		if (pos + 32 <= len)
+		{
+			input = _mm256_loadu_si256((const __m256i*)(data + pos));
+		}
+		else {
+			//Pad the tail with ASCII zeroes
+			std::uint8_t tail[32] = { 0 };
+			memcpy(tail, data + pos, len - pos);
+			input = _mm256_loadu_si256((const __m256i*)tail);
+		}
+
+		__m256i error;
+		if (_mm256_movemask_epi8(input) == 0)
+		{
+			//ASCII block, only a sequence left open by the previous block can be wrong
+			error = prev_incomplete;
+		}
+		else {
+			error = check_block(input, prev_input);
+			prev_incomplete = check_incomplete(input);
+		}
+		if (!_mm256_testz_si256(error, error))
+		{
+			failed = true;
+			break;
+		}
+		prev_input = input;
+	}
+
+	if (!failed)
+	{
+		if (_mm256_testz_si256(prev_incomplete, prev_incomplete))
+		{
+			return len;
+		}
+		//The data ends in the middle of a sequence
+		pos = len;
+	}
+
+	//Everything before the sequence crossing into the failing block is valid,
+	//find the exact offset from the lead byte of that sequence on
+	size_t restart = pos;
+	while (restart > 0 && pos - restart < 4)
+	{
+		restart--;
+		if (((unsigned char)data[restart] & 0xC0) != 0x80)
+		{
+			break;
+		}
+	}
+	return restart + first_invalid_scalar(data + restart, len - restart);
+}
+
+SIMD_TARGET("avx2")
+static void measure_avx2(const char* data, size_t len, size_t& codepoints, unsigned char& max_byte)
+{
+	__m256i total = _mm256_setzero_si256();
+	__m256i max = _mm256_setzero_si256();
+	size_t pos = 0;
+	while (pos + 32 <= len)
+	{
+		//Byte counters overflow after 255 blocks, so they are summed up in between
+		__m256i counts = _mm256_setzero_si256();
+		for (int i = 0; i < 255 && pos + 32 <= len; i++, pos += 32)
+		{
+			__m256i input = _mm256_loadu_si256((const __m256i*)(data + pos));
+			//Continuation bytes are the signed values -128 to -65
+			counts = _mm256_sub_epi8(counts, _mm256_cmpgt_epi8(input, _mm256_set1_epi8(-65)));
+			max = _mm256_max_epu8(max, input);
+		}
+		total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+	}
+
+	std::uint64_t sums[4];
+	_mm256_storeu_si256((__m256i*)sums, total);
+	codepoints += sums[0] + sums[1] + sums[2] + sums[3];
+
+	std::uint8_t maxes[32];
+	_mm256_storeu_si256((__m256i*)maxes, max);
+	for (auto&& m : maxes)
+	{
+		max_byte = std::max(max_byte, m);
+	}
+
+	measure_scalar(data + pos, len - pos, codepoints, max_byte);
+}
+
+//Shuffles moving the kept 16-bit lanes (set bits of the index) to the front
+static std::array<std::array<std::uint8_t, 16>, 256> make_compaction_table()
+{
+	std::array<std::array<std::uint8_t, 16>, 256> table;
+	for (int mask = 0; mask < 256; mask++)
+	{
+		table[mask].fill(0x80);
+		int out = 0;
+		for (int lane = 0; lane < 8; lane++)
+		{
+			if (mask & (1 << lane))
+			{
+				table[mask][out++] = (std::uint8_t)(2 * lane);
+				table[mask][out++] = (std::uint8_t)(2 * lane + 1);
+			}
+		}
+	}
+	return table;
+}
+
+static const std::array<std::array<std::uint8_t, 16>, 256> compaction_table = make_compaction_table();
+
+//Stores eight 16-bit codepoints, converted to the output width
+SIMD_TARGET("sse4.1")
+static inline void store_codepoints(__m128i values, std::uint8_t* out)
+{
+	_mm_storel_epi64((__m128i*)out, _mm_packus_epi16(values, values));
+}
+
+SIMD_TARGET("sse4.1")
+static inline void store_codepoints(__m128i values, std::uint16_t* out)
+{
+	_mm_storeu_si128((__m128i*)out, values);
+}
+
+SIMD_TARGET("sse4.1")
+static inline void store_codepoints(__m128i values, utf8::uint32_t* out)
+{
+	_mm_storeu_si128((__m128i*)out, _mm_cvtepu16_epi32(values));
+	_mm_storeu_si128((__m128i*)(out + 4), _mm_cvtepu16_epi32(_mm_srli_si128(values, 8)));
+}
+
+//Decodes 16 bytes at a time if they are ASCII and 8 bytes at a time if they
+//only contain 1 and 2 byte sequences, everything else one sequence at a time.
+//Writes up to 8 codepoints past the end of the output.
+template <typename T>
+SIMD_TARGET("sse4.1")
+static T* decode_sse41(const char* in, const char* end, T* out)
+{
+	const __m128i low6 = _mm_set1_epi16(0x3F);
+	const __m128i low5 = _mm_set1_epi16(0x1F);
+	const __m128i cont_bits = _mm_set1_epi16(0xC0);
+	const __m128i cont_tag = _mm_set1_epi16(0x80);
+	const __m128i max_cont = _mm_set1_epi16(0xBF);
+	const __m128i lead3 = _mm_set1_epi8((char)0xE0);
+
+	while (end - in >= 16)
+	{
+		__m128i bytes = _mm_loadu_si128((const __m128i*)in);
+		int high = _mm_movemask_epi8(bytes);
+		if (high == 0)
+		{
+			store_codepoints(_mm_cvtepu8_epi16(bytes), out);
+			store_codepoints(_mm_cvtepu8_epi16(_mm_srli_si128(bytes, 8)), out + 8);
+			in += 16;
+			out += 16;
+			continue;
+		}
+
+		int long_leads = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(bytes, lead3), bytes));
+		if ((long_leads & 0xFF) == 0)
+		{
+			//Compute a codepoint for every byte as if it started a sequence,
+			//then drop the continuation bytes
+			__m128i cur = _mm_cvtepu8_epi16(bytes);
+			__m128i next = _mm_cvtepu8_epi16(_mm_srli_si128(bytes, 1));
+			__m128i two_byte = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(cur, low5), 6), _mm_and_si128(next, low6));
+			__m128i is_lead = _mm_cmpgt_epi16(cur, max_cont);
+			__m128i is_cont = _mm_cmpeq_epi16(_mm_and_si128(cur, cont_bits), cont_tag);
+			__m128i values = _mm_blendv_epi8(cur, two_byte, is_lead);
+
+			int keep = ~_mm_movemask_epi8(_mm_packs_epi16(is_cont, _mm_setzero_si128())) & 0xFF;
+			values = _mm_shuffle_epi8(values, _mm_loadu_si128((const __m128i*)compaction_table[keep].data()));
+			store_codepoints(values, out);
+			out += __builtin_popcount(keep);
+			//A lead byte in the last position already consumed its continuation byte
+			in += 8 + ((unsigned char)in[7] >= 0xC0 ? 1 : 0);
+			continue;
+		}
+
+		*out++ = (T)utf8::unchecked::next(in);
+	}
+	return decode_scalar(in, end, out);
+}
+
+
+//Every codepoint takes one byte, plus one for each of the thresholds
+//0x80, 0x800 and 0x10000 it reaches. The kernels count these extra bytes
+//and stop at the first block containing an invalid codepoint, leaving it to
+//the scalar code to find.
+SIMD_TARGET("sse4.1")
+static size_t encoded_length_sse41(const std::uint8_t* begin, const std::uint8_t* end, size_t& invalid)
+{
+	const std::uint8_t* it = begin;
+	size_t length = 0;
+	for (; end - it >= 16; it += 16)
+	{
+		__m128i values = _mm_loadu_si128((const __m128i*)it);
+		length += 16 + __builtin_popcount(_mm_movemask_epi8(values));
+	}
+	return length + encoded_length_scalar(begin, it, end, invalid);
+}
+
+SIMD_TARGET("sse4.1")
+static size_t encoded_length_sse41(const std::uint16_t* begin, const std::uint16_t* end, size_t& invalid)
+{
+	const __m128i surrogate_bits = _mm_set1_epi16((short)0xF800);
+	const __m128i surrogate_tag = _mm_set1_epi16((short)0xD800);
+	const __m128i two_bytes = _mm_set1_epi16(0x80);
+	const __m128i three_bytes = _mm_set1_epi16(0x800);
+
+	const std::uint16_t* it = begin;
+	size_t length = 0;
+	for (; end - it >= 8; it += 8)
+	{
+		__m128i values = _mm_loadu_si128((const __m128i*)it);
+		__m128i surrogate = _mm_cmpeq_epi16(_mm_and_si128(values, surrogate_bits), surrogate_tag);
+		if (!_mm_testz_si128(surrogate, surrogate))
+		{
+			break;
+		}
+		__m128i ge2 = _mm_cmpeq_epi16(_mm_max_epu16(values, two_bytes), values);
+		__m128i ge3 = _mm_cmpeq_epi16(_mm_max_epu16(values, three_bytes), values);
+		//Every 16-bit lane sets two bits of the byte mask
+		length += 8 + (__builtin_popcount(_mm_movemask_epi8(ge2)) + __builtin_popcount(_mm_movemask_epi8(ge3))) / 2;
+	}
+	return length + encoded_length_scalar(begin, it, end, invalid);
+}
+
+SIMD_TARGET("sse4.1")
+static size_t encoded_length_sse41(const utf8::uint32_t* begin, const utf8::uint32_t* end, size_t& invalid)
+{
+	const __m128i surrogate_bits = _mm_set1_epi32((int)0xFFFFF800);
+	const __m128i surrogate_tag = _mm_set1_epi32(0xD800);
+	const __m128i max_cp = _mm_set1_epi32(0x10FFFF);
+	const __m128i two_bytes = _mm_set1_epi32(0x80);
+	const __m128i three_bytes = _mm_set1_epi32(0x800);
+	const __m128i four_bytes = _mm_set1_epi32(0x10000);
+
+	const utf8::uint32_t* it = begin;
+	size_t length = 0;
+	for (; end - it >= 4; it += 4)
+	{
+		__m128i values = _mm_loadu_si128((const __m128i*)it);
+		__m128i surrogate = _mm_cmpeq_epi32(_mm_and_si128(values, surrogate_bits), surrogate_tag);
+		__m128i in_range = _mm_cmpeq_epi32(_mm_min_epu32(values, max_cp), values);
+		if (!_mm_testc_si128(_mm_andnot_si128(surrogate, in_range), _mm_set1_epi32(-1)))
+		{
+			break;
+		}
+		__m128i ge2 = _mm_cmpeq_epi32(_mm_max_epu32(values, two_bytes), values);
+		__m128i ge3 = _mm_cmpeq_epi32(_mm_max_epu32(values, three_bytes), values);
+		__m128i ge4 = _mm_cmpeq_epi32(_mm_max_epu32(values, four_bytes), values);
+		length += 4 + __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(ge2)))
+			+ __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(ge3)))
+			+ __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(ge4)));
+	}
+	return length + encoded_length_scalar(begin, it, end, invalid);
+}
+
+//Shuffles taking the low byte of every 16-bit lane and also the high byte
+//of lanes whose bit is set in the index
+static std::array<std::array<std::uint8_t, 16>, 256> make_expansion_table()
+{
+	std::array<std::array<std::uint8_t, 16>, 256> table;
+	for (int mask = 0; mask < 256; mask++)
+	{
+		table[mask].fill(0x80);
+		int out = 0;
+		for (int lane = 0; lane < 8; lane++)
+		{
+			table[mask][out++] = (std::uint8_t)(2 * lane);
+			if (mask & (1 << lane))
+			{
+				table[mask][out++] = (std::uint8_t)(2 * lane + 1);
+			}
+		}
+	}
+	return table;
+}
+
+static const std::array<std::array<std::uint8_t, 16>, 256> expansion_table = make_expansion_table();
+
+//Loads eight codepoints as 16-bit lanes. Codepoints above U+FFFF saturate to 0xFFFF.
+SIMD_TARGET("sse4.1")
+static inline __m128i load_codepoints(const std::uint8_t* in)
+{
+	return _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)in));
+}
+
+SIMD_TARGET("sse4.1")
+static inline __m128i load_codepoints(const std::uint16_t* in)
+{
+	return _mm_loadu_si128((const __m128i*)in);
+}
+
+SIMD_TARGET("sse4.1")
+static inline __m128i load_codepoints(const utf8::uint32_t* in)
+{
+	return _mm_packus_epi32(_mm_loadu_si128((const __m128i*)in), _mm_loadu_si128((const __m128i*)(in + 4)));
+}
+
+//Encodes eight codepoints at a time if they are all below U+0800,
+//anything else is encoded by the scalar code.
+//Writes up to 16 bytes past the end of the output.
+template <typename T>
+SIMD_TARGET("sse4.1")
+static char* encode_sse41(const T* in, const T* end, char* out)
+{
+	const __m128i not_ascii = _mm_set1_epi16((short)0xFF80);
+	const __m128i not_two_byte = _mm_set1_epi16((short)0xF800);
+	const __m128i low6 = _mm_set1_epi16(0x3F);
+	const __m128i lead_tag = _mm_set1_epi16(0xC0);
+	const __m128i cont_tag = _mm_set1_epi16(0x80);
+
+	while (end - in >= 8)
+	{
+		__m128i values = load_codepoints(in);
+		if (_mm_testz_si128(values, not_ascii))
+		{
+			_mm_storel_epi64((__m128i*)out, _mm_packus_epi16(values, values));
+			in += 8;
+			out += 8;
+			continue;
+		}
+		if (_mm_testz_si128(values, not_two_byte))
+		{
+			//Put the lead byte into the low and the continuation byte into the high
+			//half of every lane, then squeeze out the high halves of ASCII lanes
+			__m128i lead = _mm_or_si128(_mm_srli_epi16(values, 6), lead_tag);
+			__m128i cont = _mm_or_si128(_mm_and_si128(values, low6), cont_tag);
+			__m128i two_byte = _mm_or_si128(lead, _mm_slli_epi16(cont, 8));
+			__m128i is_ascii = _mm_cmplt_epi16(values, cont_tag);
+			__m128i bytes = _mm_blendv_epi8(two_byte, values, is_ascii);
+
+			int expand = ~_mm_movemask_epi8(_mm_packs_epi16(is_ascii, _mm_setzero_si128())) & 0xFF;
+			bytes = _mm_shuffle_epi8(bytes, _mm_loadu_si128((const __m128i*)expansion_table[expand].data()));
+			_mm_storeu_si128((__m128i*)out, bytes);
+			in += 8;
+			out += 8 + __builtin_popcount(expand);
+			continue;
+		}
+		out = encode_scalar(in, in + 8, out);
+		in += 8;
+	}
+	return encode_scalar(in, end, out);
+}
+
+#endif
+
+namespace utf8
+{
+	size_t first_invalid(const char* data, size_t len)
+	{
+#ifdef SIMD_X86
+		if (simd::has_avx2())
+		{
+			return first_invalid_avx2(data, len);
+		}
+#endif
+		return first_invalid_scalar(data, len);
+	}
+
+	template <typename vector>
+	static vector decode_to(const char* data, size_t len, size_t codepoints)
+	{
+		//The vectorized decoder may write up to 8 codepoints past the end
+		vector result(codepoints + 8);
+		auto out = result.data();
+		//Decoded in blocks ending at the start of a char, reporting the progress after each
+		for (size_t pos = 0; pos < len;)
+		{
+			size_t end = std::min(pos + progress_block, len);
+			while (end < len && ((unsigned char)data[end] & 0xC0) == 0x80)
+			{
+				end++;
+			}
+#ifdef SIMD_X86
+			if (simd::has_sse41())
+			{
+				out = decode_sse41(data + pos, data + end, out);
+			}
+			else {
+				out = decode_scalar(data + pos, data + end, out);
+			}
+#else
+			out = decode_scalar(data + pos, data + end, out);
+#endif
+			pos = end;
+			report_progress(pos, len);
+		}
+		result.resize(out - result.data());
+		return result;
+	}
+
+	UnicodeString decode_valid(const char* data, size_t len)
+	{
+		size_t codepoints = 0;
+		unsigned char max_byte = 0;
+#ifdef SIMD_X86
+		if (simd::has_avx2())
+		{
+			measure_avx2(data, len, codepoints, max_byte);
+		}
+		else {
+			measure_scalar(data, len, codepoints, max_byte);
+		}
+#else
+		measure_scalar(data, len, codepoints, max_byte);
+#endif
+
+		//Lead bytes 0xC2 and 0xC3 encode U+0080 to U+00FF, 0xF0 and up the astral planes
+		if (max_byte >= 0xF0)
+		{
+			return UnicodeString::from_utf32(decode_to<UnicodeString::utf32_vector>(data, len, codepoints));
+		}
+		if (max_byte >= 0xC4)
+		{
+			return UnicodeString::from_ucs2(decode_to<UnicodeString::ucs2_vector>(data, len, codepoints));
+		}
+		return UnicodeString::from_latin1(decode_to<UnicodeString::latin1_vector>(data, len, codepoints));
+	}
+
+	size_t encoded_length(const UnicodeString& str, size_t pos, size_t count, size_t& invalid)
+	{
+		size_t length = 0;
+		str.visit([&](auto begin, auto)
+		{
+#ifdef SIMD_X86
+			if (simd::has_sse41())
+			{
+				length = encoded_length_sse41(begin + pos, begin + pos + count, invalid);
+				return;
+			}
+#endif
+			length = encoded_length_scalar(begin + pos, begin + pos, begin + pos + count, invalid);
+		});
+		invalid += pos;
+		return length;
+	}
+
+	char* encode_valid(const UnicodeString& str, size_t pos, size_t count, char* out)
+	{
+		str.visit([&](auto begin, auto)
+		{
+#ifdef SIMD_X86
+			if (simd::has_sse41())
+			{
+				out = encode_sse41(begin + pos, begin + pos + count, out);
+				return;
+			}
+#endif
+			out = encode_scalar(begin + pos, begin + pos + count, out);
+		});
+		return out;
+	}
+}
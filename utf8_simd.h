@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+
+#include "unicode_string.h"
+
+namespace utf8
+{
+	//Returns the offset of the first invalid UTF-8 sequence in the buffer,
+	//or len if the whole buffer is valid UTF-8.
+	//Uses the same notion of validity as utf8::find_invalid, but runs vectorized
+	//where the CPU supports it.
+	size_t first_invalid(const char* data, size_t len);
+
+	//Decodes a buffer that first_invalid found to be valid UTF-8.
+	//The result is stored in the narrowest width able to hold all codepoints.
+	UnicodeString decode_valid(const char* data, size_t len);
+
+	//Returns the number of bytes needed to encode count codepoints starting at pos as UTF-8.
+	//invalid is set to the index of the first codepoint that cannot be encoded
+	//(a surrogate or above U+10FFFF), or to pos + count if there is none.
+	size_t encoded_length(const UnicodeString& str, size_t pos, size_t count, size_t& invalid);
+
+	//Encodes count codepoints starting at pos, which must all be encodable.
+	//out must have room for their encoded length plus 16 bytes.
+	//Returns the end of the written bytes.
+	char* encode_valid(const UnicodeString& str, size_t pos, size_t count, char* out);
+}